@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mpi.h>
+#include "FreeImage.h"
+#include "palette_png.h"
+#include "kmc.h"
+#include "image_load.h"
+
+
+long long random_pixel(long long numberOfPixels);
+void gather_samples(unsigned char *band, long long firstPixel, long long bandPixels, long long *sampleIndices, int numberOfSamples, unsigned char *samples);
+long long kmeans_mpi(unsigned char *band, int width, int bandHeight, long long firstPixel, long long numberOfPixels, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices);
+
+
+int main(int argc, char *argv[]) {
+    MPI_Init(&argc, &argv);
+
+    int rank, numberOfRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numberOfRanks);
+
+    char imageInName[512];
+    char imageOutName[512];
+    int numberOfClusters = 0;
+    int numberOfIterations = 0;
+    int palettePng = 0;
+    int pngLevel = -1;
+    char *positional[4];
+    int numberOfPositional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--palette-png") == 0) {
+            palettePng = 1;
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            pngLevel = atoi(argv[++i]) < 9 ? atoi(argv[i]) : 9;
+        } else if (strncmp(argv[i], "--", 2) != 0 && numberOfPositional < 4) {
+            positional[numberOfPositional++] = argv[i];
+        } else {
+            numberOfPositional = -1;
+            break;
+        }
+    }
+
+    if (numberOfPositional != 4) {
+        if (rank == 0) {
+            printf("USAGE: mpirun -np N ./CPU_MPI input_image output_image number_of_clusters number_of_iterations [--palette-png] [--png-level 0-9]\n");
+            printf("Every rank clusters a band of image rows, rank 0 loads and saves the image.\n");
+        }
+        MPI_Finalize();
+        exit(EXIT_SUCCESS);
+    }
+
+    snprintf(imageInName, sizeof(imageInName), "%s", positional[0]);
+    snprintf(imageOutName, sizeof(imageOutName), "%s", positional[1]);
+    numberOfClusters = atoi(positional[2]);
+    numberOfIterations = atoi(positional[3]);
+
+    // KMC output needs the same palette and index map as palette PNG output
+    int kmcOutput = kmc_is_kmc(imageOutName);
+    if ((palettePng || kmcOutput) && numberOfClusters > 256) {
+        if (rank == 0) {
+            fprintf(stderr, "--palette-png and .kmc output need at most 256 clusters.\n");
+        }
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    // Rank 0 loads the whole image
+    int size[2] = {0, 0};
+    unsigned char *image = NULL;
+    if (rank == 0) {
+        int pitch;
+        if (kmc_is_kmc(imageInName)) {
+            image = kmc_read(imageInName, &size[0], &size[1]);
+        } else {
+            image = load_image_file(imageInName, &size[0], &size[1], &pitch);
+        }
+        if (image == NULL) {
+            fprintf(stderr, "Could not load image '%s'.\n", imageInName);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Bcast(size, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    int width = size[0];
+    int height = size[1];
+
+    // Split the rows into one band per rank, the first height % numberOfRanks bands get one row more
+    int *bandRows = malloc(numberOfRanks * sizeof(int));
+    int *bandFirstRow = malloc(numberOfRanks * sizeof(int));
+    for (int r = 0; r < numberOfRanks; r++) {
+        bandRows[r] = height / numberOfRanks + (r < height % numberOfRanks);
+        bandFirstRow[r] = r == 0 ? 0 : bandFirstRow[r - 1] + bandRows[r - 1];
+    }
+    long long firstPixel = (long long)bandFirstRow[rank] * width;
+
+    // Whole rows are sent as one element, so the counts stay small however large the image is
+    MPI_Datatype rowType, indexRowType;
+    MPI_Type_contiguous(width * 4, MPI_UNSIGNED_CHAR, &rowType);
+    MPI_Type_contiguous(width, MPI_UNSIGNED_CHAR, &indexRowType);
+    MPI_Type_commit(&rowType);
+    MPI_Type_commit(&indexRowType);
+
+    // Rank 0 keeps its band in place at the start of the image
+    unsigned char *band = rank == 0 ? image : malloc((size_t)bandRows[rank] * width * 4);
+    MPI_Scatterv(image, bandRows, bandFirstRow, rowType, rank == 0 ? MPI_IN_PLACE : band, bandRows[rank], rowType, 0, MPI_COMM_WORLD);
+
+    // Every rank draws the same random sample indices
+    unsigned int seed = time(NULL);
+    MPI_Bcast(&seed, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+    srand(seed);
+
+    unsigned char *palette = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    unsigned char *indices = NULL;
+    unsigned char *bandIndices = NULL;
+    if (palettePng || kmcOutput) {
+        bandIndices = malloc((size_t)bandRows[rank] * width);
+        indices = rank == 0 ? malloc((size_t)width * height) : NULL;
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+
+    // Image compression using k-means clustering algorithm
+    long long inertia = kmeans_mpi(band, width, bandRows[rank], firstPixel, (long long)width * height, numberOfClusters, numberOfIterations, palette, bandIndices);
+
+    double clusteringTime = MPI_Wtime() - start;
+
+    // Collect the bands of the output on rank 0
+    if (bandIndices != NULL) {
+        MPI_Gatherv(bandIndices, bandRows[rank], indexRowType, indices, bandRows, bandFirstRow, indexRowType, 0, MPI_COMM_WORLD);
+    } else {
+        MPI_Gatherv(rank == 0 ? MPI_IN_PLACE : band, bandRows[rank], rowType, image, bandRows, bandFirstRow, rowType, 0, MPI_COMM_WORLD);
+    }
+    double elapsed = MPI_Wtime() - start;
+
+    if (rank == 0) {
+        printf("Procesi: %d\n", numberOfRanks);
+        printf("Čas izvajanja programa: %f sekund (gručenje %f sekund)\n", elapsed, clusteringTime);
+        printf("Inercija: %lld\n", inertia);
+
+        // Save output image
+        struct timespec saveStart, saveFinish;
+        clock_gettime(CLOCK_MONOTONIC, &saveStart);
+        int saved;
+        if (kmcOutput) {
+            saved = kmc_write(imageOutName, indices, 1, palette, numberOfClusters, width, height);
+        } else if (pngLevel >= 0) {
+            // Parallel encoder on a background thread, the palette is printed in the meantime
+            struct PngJob job = {.fileName = imageOutName, .data = palettePng ? indices : image, .width = width, .height = height,
+                                 .pitch = palettePng ? width : width * 4, .palette = palettePng ? palette : NULL,
+                                 .numberOfColors = numberOfClusters, .level = pngLevel};
+            png_save_async(&job);
+            print_palette(palette, numberOfClusters);
+            saved = png_save_wait(&job);
+        } else if (palettePng) {
+            saved = save_palette_png(imageOutName, indices, palette, numberOfClusters, width, height);
+        } else {
+            saved = save_rgba_png(imageOutName, image, width, height, width * 4);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &saveFinish);
+        if (saved) {
+            print_output_stats(imageOutName, (saveFinish.tv_sec - saveStart.tv_sec) + (saveFinish.tv_nsec - saveStart.tv_nsec) / 1000000000.0, (long long)width * height);
+        } else {
+            fprintf(stderr, "Could not save image '%s'.\n", imageOutName);
+        }
+    }
+
+    // Cleanup
+    if (band != image) {
+        free(band);
+    }
+    free(image);
+    free(palette);
+    free(indices);
+    free(bandIndices);
+    free(bandRows);
+    free(bandFirstRow);
+    MPI_Type_free(&rowType);
+    MPI_Type_free(&indexRowType);
+
+    MPI_Finalize();
+    return 0;
+}
+
+
+/**
+ *   @brief Clusters the image with its rows distributed over all ranks
+ *
+ *   Every rank assigns the samples of its own band; the per-cluster sums, counts and the inertia are
+ *   combined with one MPI_Allreduce per iteration, so all ranks compute the same centroids.
+ *
+ *   @param band raw data of the rows owned by this rank, rebuilt from the centroids if indices is NULL
+ *   @param width image width
+ *   @param bandHeight number of rows owned by this rank
+ *   @param firstPixel index of the first sample of the band in the whole image
+ *   @param numberOfPixels number of samples in the whole image
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations number of iterations
+ *   @param palette centroids after the last iteration, 4 bytes each in the byte order of the image
+ *   @param indices cluster index of every sample of the band (k <= 256) or NULL
+ *
+ *   @return Sum of squared distances of the last assignment over the whole image (inertia)
+ */
+long long kmeans_mpi(unsigned char *band, int width, int bandHeight, long long firstPixel, long long numberOfPixels, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices) {
+    long long bandPixels = (long long)width * bandHeight;
+    int totalsLength = numberOfClusters * 5 + 1;                               // Sums of RGBA values, counts and inertia
+    long long *totals = malloc(totalsLength * sizeof(long long));
+    long long *sampleIndices = malloc(numberOfClusters * sizeof(long long));
+    unsigned char *samples = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    long long inertia = 0;
+
+    // Random samples as initial centroids
+    for (int k = 0; k < numberOfClusters; k++) {
+        sampleIndices[k] = random_pixel(numberOfPixels);
+    }
+    gather_samples(band, firstPixel, bandPixels, sampleIndices, numberOfClusters, palette);
+
+    for (int i = 0; i <= numberOfIterations; i++) {
+        int lastPass = i == numberOfIterations;
+        memset(totals, 0, totalsLength * sizeof(long long));
+
+        // Assign every sample of the band; the last pass only writes the output
+        #ifdef _OPENMP
+        #pragma omp parallel for reduction(+ : totals[:totalsLength])
+        #endif
+        for (long long j = 0; j < bandPixels; j++) {
+            size_t base = j * 4;
+            int nearestCentroidIndex = 0;
+            int minDeviation = -1;
+
+            for (int k = 0; k < numberOfClusters * 4; k += 4) {
+                int deviation = (band[base + 0] - palette[k + 0]) * (band[base + 0] - palette[k + 0]) +
+                                (band[base + 1] - palette[k + 1]) * (band[base + 1] - palette[k + 1]) +
+                                (band[base + 2] - palette[k + 2]) * (band[base + 2] - palette[k + 2]) +
+                                (band[base + 3] - palette[k + 3]) * (band[base + 3] - palette[k + 3]);
+                if (minDeviation < 0 || deviation < minDeviation) {
+                    minDeviation = deviation;
+                    nearestCentroidIndex = k;
+                }
+            }
+
+            if (lastPass) {
+                if (indices != NULL) {
+                    indices[j] = nearestCentroidIndex / 4;
+                } else {
+                    band[base + 0] = palette[nearestCentroidIndex + 0];
+                    band[base + 1] = palette[nearestCentroidIndex + 1];
+                    band[base + 2] = palette[nearestCentroidIndex + 2];
+                    band[base + 3] = palette[nearestCentroidIndex + 3];
+                }
+            } else {
+                totals[nearestCentroidIndex + 0] += band[base + 0];
+                totals[nearestCentroidIndex + 1] += band[base + 1];
+                totals[nearestCentroidIndex + 2] += band[base + 2];
+                totals[nearestCentroidIndex + 3] += band[base + 3];
+                totals[numberOfClusters * 4 + nearestCentroidIndex / 4]++;
+                totals[totalsLength - 1] += minDeviation;
+            }
+        }
+
+        if (lastPass) {
+            break;
+        }
+
+        MPI_Allreduce(MPI_IN_PLACE, totals, totalsLength, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        inertia = totals[totalsLength - 1];
+
+        // Empty clusters get a random sample; all ranks see the same counts and draw the same indices
+        int numberOfEmpty = 0;
+        for (int k = 0; k < numberOfClusters; k++) {
+            if (totals[numberOfClusters * 4 + k] == 0) {
+                sampleIndices[numberOfEmpty++] = random_pixel(numberOfPixels);
+            }
+        }
+        if (numberOfEmpty > 0) {
+            gather_samples(band, firstPixel, bandPixels, sampleIndices, numberOfEmpty, samples);
+        }
+
+        // Set centroid RGBA values by dividing the sums by the number of samples in the cluster
+        for (int k = 0, empty = 0; k < numberOfClusters; k++) {
+            long long n = totals[numberOfClusters * 4 + k];
+            for (int channel = 0; channel < 4; channel++) {
+                palette[k * 4 + channel] = n == 0 ? samples[empty * 4 + channel] : totals[k * 4 + channel] / n;
+            }
+            empty += n == 0;
+        }
+    }
+
+    free(totals);
+    free(sampleIndices);
+    free(samples);
+
+    return inertia;
+}
+
+
+/**
+ *   @brief Makes samples of the whole image available on every rank
+ *
+ *   Each rank fills in the samples inside its own band and zeros elsewhere, the maximum over all
+ *   ranks is then the sample itself.
+ *
+ *   @param band raw data of the rows owned by this rank
+ *   @param firstPixel index of the first sample of the band in the whole image
+ *   @param bandPixels number of samples in the band
+ *   @param sampleIndices indices of the samples in the whole image
+ *   @param numberOfSamples number of samples
+ *   @param samples RGBA values of the samples, 4 bytes each, set on return
+ */
+void gather_samples(unsigned char *band, long long firstPixel, long long bandPixels, long long *sampleIndices, int numberOfSamples, unsigned char *samples) {
+    memset(samples, 0, numberOfSamples * 4 * sizeof(unsigned char));
+    for (int s = 0; s < numberOfSamples; s++) {
+        long long local = sampleIndices[s] - firstPixel;
+        if (local >= 0 && local < bandPixels) {
+            memcpy(samples + s * 4, band + local * 4, 4);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, samples, numberOfSamples * 4, MPI_UNSIGNED_CHAR, MPI_MAX, MPI_COMM_WORLD);
+}
+
+
+/**
+ *   @brief Returns a random sample index of the whole image
+ *
+ *   @param numberOfPixels number of samples in the image
+ *
+ *   @return Random index that is greater or equal to 0 and smaller than numberOfPixels
+ */
+long long random_pixel(long long numberOfPixels) {
+    unsigned long long value = ((unsigned long long)rand() << 31) ^ (unsigned long long)rand();
+    return value % numberOfPixels;
+}
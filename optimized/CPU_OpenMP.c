@@ -1,84 +1,468 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <omp.h>
 #include "FreeImage.h"
+#include "palette_png.h"
+#include "kmc.h"
+#include "image_load.h"
+#include "stream_kmeans.h"
+#include "centroid_kdtree.h"
+#include "filtering_kmeans.h"
+#include "gemm_assign.h"
+#include "pde_assign.h"
+#include "coherent_assign.h"
+#include "palette_lut.h"
+#include "palette_file.h"
+#include "palette_cache.h"
 
 
+// Nearest-centroid search used by kmeans_sequential and apply_palette (--assign)
+enum AssignMode { ASSIGN_BRUTE, ASSIGN_KDTREE, ASSIGN_FILTER, ASSIGN_GEMM, ASSIGN_PDE, ASSIGN_COHERENT, ASSIGN_LUT };
+enum AssignMode assignMode = ASSIGN_BRUTE;
+
+// Distance evaluations and assigned samples of the brute, pde, coherent and lut searches
+long long distanceEvaluations = 0;
+long long assignedSamples = 0;
+
+// Convergence: iterations stop once no centroid channel moves by more than maxShift (-1 runs all of them)
+int maxShift = -1;
+long long iterationsRun = 0;
+
+// Time budget (--time-budget-ms) counted from programStart; -1 runs without one
+#define TIME_BUDGET_RESERVE_NS 100      // Estimated rebuild and PNG encoding time per pixel, kept free at the end
+int timeBudgetMs = -1;
+struct timespec programStart;
+int budgetExhausted = 0;
+
 int random_integer(int min, int max);
-void kmeans_sequential(unsigned char *imageIn, int width, int height, int numberOfClusters, int numberOfIterations);
+long long kmeans_sequential(unsigned char *imageIn, int width, int height, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices, int warmStart);
+long long apply_palette(unsigned char *image, int width, int height, unsigned char *palette, int numberOfClusters, unsigned char *indices);
+long long kmeans_filtering(unsigned char *image, int width, int height, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices, int warmStart);
+unsigned char *downsample(unsigned char *image, int width, int height, int pitch, int *outWidth, int *outHeight);
+long long kmeans_pyramid(unsigned char *image, int width, int height, int pitch, int numberOfClusters, int numberOfIterations, int numberOfLevels, int refineIterations, unsigned char *palette, unsigned char *indices);
+void kmeans_weighted(unsigned char *samples, long long *weights, int numberOfSamples, int numberOfClusters, int numberOfIterations, unsigned char *palette, long long *counts, unsigned int seed);
+long long kmeans_tiled(unsigned char *image, int width, int height, int pitch, int numberOfClusters, int numberOfIterations, int tileSize, unsigned char *palette, unsigned char *indices);
+int kmeans_sequence(const char *outputDirectory, char **inputNames, int numberOfFrames, int numberOfClusters, int numberOfIterations, int palettePng, int coldStart);
+int decode_kmc(const char *inputName, const char *outputName, int palettePng, int pngLevel);
+double seconds_since(struct timespec start);
 
 
 int main(int argc, char *argv[]) {
+    clock_gettime(CLOCK_MONOTONIC, &programStart);
     char imageInName[100];
     char imageOutName[100];
     int numberOfClusters = 0;
     int numberOfIterations = 0;
-    if (argc != 5) {
-        printf("USAGE: ./CPU_OpenMP input_image output_image number_of_clusters number_of_iterations\n");
+    int palettePng = 0;
+    int pngLevel = -1;
+    int trainScale = 1;
+    int numberOfLevels = 1;
+    int refineIterations = 2;
+    int tileSize = 0;
+    int stream = 0;
+    int stripRows = 256;
+    int assignGiven = 0;
+    char *paletteIn = NULL;
+    char *paletteOut = NULL;
+    int sequence = 0;
+    int coldStart = 0;
+    char *cacheDir = NULL;
+    double cacheMaxDistance = 0.05;
+    int cacheApply = 0;
+    char **positional = malloc(argc * sizeof(char *));
+    int numberOfPositional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--palette-png") == 0) {
+            palettePng = 1;
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            pngLevel = atoi(argv[++i]) < 9 ? atoi(argv[i]) : 9;
+        } else if (strcmp(argv[i], "--train-scale") == 0 && i + 1 < argc) {
+            trainScale = atoi(argv[++i]) > 1 ? atoi(argv[i]) : 1;
+        } else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+            numberOfLevels = atoi(argv[++i]) > 1 ? atoi(argv[i]) : 1;
+        } else if (strcmp(argv[i], "--refine") == 0 && i + 1 < argc) {
+            refineIterations = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+        } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            tileSize = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+        } else if (strcmp(argv[i], "--assign") == 0 && i + 1 < argc) {
+            i++;
+            assignGiven = 1;
+            if (strcmp(argv[i], "brute") == 0) {
+                assignMode = ASSIGN_BRUTE;
+            } else if (strcmp(argv[i], "kdtree") == 0) {
+                assignMode = ASSIGN_KDTREE;
+            } else if (strcmp(argv[i], "filter") == 0) {
+                assignMode = ASSIGN_FILTER;
+            } else if (strcmp(argv[i], "gemm") == 0) {
+                assignMode = ASSIGN_GEMM;
+            } else if (strcmp(argv[i], "pde") == 0) {
+                assignMode = ASSIGN_PDE;
+            } else if (strcmp(argv[i], "coherent") == 0) {
+                assignMode = ASSIGN_COHERENT;
+            } else if (strcmp(argv[i], "lut") == 0) {
+                assignMode = ASSIGN_LUT;
+            } else {
+                numberOfPositional = -1;
+                break;
+            }
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+            paletteIn = argv[++i];
+        } else if (strcmp(argv[i], "--save-palette") == 0 && i + 1 < argc) {
+            paletteOut = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-distance") == 0 && i + 1 < argc) {
+            cacheMaxDistance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-apply") == 0) {
+            cacheApply = 1;
+        } else if (strcmp(argv[i], "--sequence") == 0) {
+            sequence = 1;
+        } else if (strcmp(argv[i], "--cold-start") == 0) {
+            coldStart = 1;
+        } else if (strcmp(argv[i], "--max-shift") == 0 && i + 1 < argc) {
+            maxShift = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+        } else if (strcmp(argv[i], "--time-budget-ms") == 0 && i + 1 < argc) {
+            timeBudgetMs = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--strip-rows") == 0 && i + 1 < argc) {
+            stripRows = atoi(argv[++i]) > 1 ? atoi(argv[i]) : 1;
+        } else if (strncmp(argv[i], "--", 2) != 0) {
+            positional[numberOfPositional++] = argv[i];
+        } else {
+            numberOfPositional = -1;
+            break;
+        }
+    }
+
+    // A .kmc input with an image output is only decoded
+    int decode = !sequence && numberOfPositional >= 2 && kmc_is_kmc(positional[0]) && !kmc_is_kmc(positional[1]);
+
+    if (sequence ? numberOfPositional < 4 : numberOfPositional != (paletteIn != NULL || decode ? 2 : 4)) {
+        printf("USAGE: ./CPU_OpenMP input_image output_image number_of_clusters number_of_iterations [--palette-png] [--png-level 0-9] [--train-scale n] [--levels n [--refine n]] [--tile-size n] [--assign brute|kdtree|filter|gemm|pde|coherent|lut] [--stream [--strip-rows n]] [--save-palette file] [--max-shift n] [--time-budget-ms ms] [--cache dir [--cache-distance d] [--cache-apply]]\n");
+        printf("       ./CPU_OpenMP input_image output_image --palette file [--palette-png] [--png-level 0-9] [--assign ...]\n");
+        printf("       ./CPU_OpenMP input.kmc output_image [--palette-png] [--png-level 0-9]\n");
+        printf("--save-palette writes the centroids and run statistics (JSON for names ending in .json, binary otherwise);\n");
+        printf("--palette maps the image to a saved palette in a single pass without training.\n");
+        printf("       ./CPU_OpenMP --sequence output_dir number_of_clusters max_iterations frame... | frame_directory [--palette-png] [--assign ...] [--max-shift n] [--cold-start]\n");
+        printf("--sequence starts every frame from the centroids of the previous one; --max-shift n stops the iterations once no\n");
+        printf("centroid channel moves by more than n (default 0 in sequence mode, otherwise all iterations run).\n");
+        printf("--cache dir reuses palettes of images with the same colour histogram signature (k included) and stores new ones;\n");
+        printf("a signature within L1 distance d (0 to 2, default 0.05) warm-starts training, or is applied directly with --cache-apply.\n");
+        printf("--time-budget-ms stops iterating when the next iteration would not finish, with rebuilding and saving, within ms\n");
+        printf("milliseconds of the program start, and keeps the centroids with the lowest measured inertia.\n");
+        printf("Input and output names ending in .kmc are read and written as KMC files; a .kmc input with an image output is\n");
+        printf("decoded to exactly the stored pixels without clustering, and every written .kmc file is read back and checked.\n");
+        printf("Inputs may be PNG, JPEG, TIFF, BMP, WebP, PPM or any other format FreeImage reads.\n");
+        printf("--stream clusters a binary PPM/PAM image of any size strip by strip without loading it into memory.\n");
         exit(EXIT_SUCCESS);
     }
 
-    sprintf(imageInName, "%s", argv[1]);
-    sprintf(imageOutName, "%s", argv[2]);
-    numberOfClusters = atoi(argv[3]);
-    numberOfIterations = atoi(argv[4]);
+    // Frames of a sequence go to the output directory under their own names
+    if (sequence) {
+        if (pngLevel >= 0 || trainScale > 1 || numberOfLevels > 1 || tileSize > 0 || stream || paletteIn != NULL || paletteOut != NULL || cacheDir != NULL || timeBudgetMs >= 0) {
+            fprintf(stderr, "--sequence cannot be combined with --png-level, --train-scale, --levels, --tile-size, --stream, palette files, --cache or --time-budget-ms.\n");
+            exit(EXIT_FAILURE);
+        }
+        numberOfClusters = atoi(positional[1]);
+        if (palettePng && numberOfClusters > 256) {
+            fprintf(stderr, "--palette-png needs at most 256 clusters.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (maxShift < 0) {
+            maxShift = 0;
+        }
+
+        // A single directory argument stands for the PNG files in it
+        int numberOfFrames = numberOfPositional - 3;
+        char **frames = numberOfFrames == 1 ? list_png_files(positional[3], &numberOfFrames) : NULL;
+        if (frames == NULL && numberOfFrames == 0) {
+            fprintf(stderr, "No frames: no PNG files in '%s'.\n", positional[3]);
+            exit(EXIT_FAILURE);
+        }
+        int listed = frames != NULL;
+        if (!listed) {
+            frames = positional + 3;
+        }
+
+        srand((unsigned) time(NULL));
+        int failed = kmeans_sequence(positional[0], frames, numberOfFrames, numberOfClusters, atoi(positional[2]), palettePng, coldStart);
+        for (int i = 0; listed && i < numberOfFrames; i++) {
+            free(frames[i]);
+        }
+        if (listed) {
+            free(frames);
+        }
+        free(positional);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    sprintf(imageInName, "%s", positional[0]);
+    sprintf(imageOutName, "%s", positional[1]);
+
+    if (decode) {
+        if (paletteIn != NULL || paletteOut != NULL || trainScale > 1 || numberOfLevels > 1 || tileSize > 0 || stream || cacheDir != NULL || timeBudgetMs >= 0 || maxShift >= 0 || assignGiven) {
+            fprintf(stderr, "Decoding a .kmc input only takes --palette-png and --png-level.\n");
+            exit(EXIT_FAILURE);
+        }
+        int decoded = decode_kmc(imageInName, imageOutName, palettePng, pngLevel);
+        free(positional);
+        exit(decoded ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // A saved palette replaces training, the image only gets one nearest-centroid pass
+    unsigned char *savedPalette = NULL;
+    if (paletteIn != NULL) {
+        if (numberOfLevels > 1 || trainScale > 1 || tileSize > 0 || stream) {
+            fprintf(stderr, "--palette cannot be combined with --levels, --train-scale, --tile-size or --stream.\n");
+            exit(EXIT_FAILURE);
+        }
+        savedPalette = palette_load(paletteIn, &numberOfClusters);
+        if (savedPalette == NULL) {
+            fprintf(stderr, "Could not read palette '%s'.\n", paletteIn);
+            exit(EXIT_FAILURE);
+        }
+        if (!assignGiven) {
+            assignMode = ASSIGN_LUT;
+        }
+    } else {
+        numberOfClusters = atoi(positional[2]);
+        numberOfIterations = atoi(positional[3]);
+    }
+
+    if (cacheDir != NULL && (numberOfLevels > 1 || trainScale > 1 || tileSize > 0 || stream || paletteIn != NULL)) {
+        fprintf(stderr, "--cache cannot be combined with --levels, --train-scale, --tile-size, --stream or --palette.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (timeBudgetMs >= 0 && (numberOfLevels > 1 || trainScale > 1 || tileSize > 0 || stream || paletteIn != NULL || assignMode == ASSIGN_FILTER)) {
+        fprintf(stderr, "--time-budget-ms cannot be combined with --levels, --train-scale, --tile-size, --stream, --palette or --assign filter.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((numberOfLevels > 1) + (trainScale > 1) + (tileSize > 0) > 1) {
+        fprintf(stderr, "--levels, --train-scale and --tile-size cannot be combined.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (stream) {
+        if (palettePng || pngLevel >= 0 || trainScale > 1 || numberOfLevels > 1 || tileSize > 0 || paletteOut != NULL || kmc_is_kmc(imageInName) || kmc_is_kmc(imageOutName)) {
+            fprintf(stderr, "--stream reads and writes PPM/PAM only and cannot be combined with other options.\n");
+            exit(EXIT_FAILURE);
+        }
+        srand((unsigned) time(NULL));
+        exit(stream_kmeans(imageInName, imageOutName, numberOfClusters, numberOfIterations, stripRows) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // KMC output needs the same palette and index map as palette PNG output
+    int kmcOutput = kmc_is_kmc(imageOutName);
+    if ((palettePng || kmcOutput) && numberOfClusters > 256) {
+        fprintf(stderr, "--palette-png and .kmc output need at most 256 clusters.\n");
+        exit(EXIT_FAILURE);
+    }
 
     time_t t;
     srand((unsigned) time(&t));
 
-	FIBITMAP *imageBitmap = FreeImage_Load(FIF_PNG, imageInName, PNG_DEFAULT);
-    FIBITMAP *imageBitmap32 = FreeImage_ConvertTo32Bits(imageBitmap);
-
-    int width = FreeImage_GetWidth(imageBitmap32);
-    int height = FreeImage_GetHeight(imageBitmap32);
-    int pitch = FreeImage_GetPitch(imageBitmap32);
+    int width, height, pitch;
+    unsigned char *image;
+    if (kmc_is_kmc(imageInName)) {
+        // Decode a previously written KMC file
+        struct timespec decodeStart, decodeFinish;
+        clock_gettime(CLOCK_MONOTONIC, &decodeStart);
+        image = kmc_read(imageInName, &width, &height);
+        clock_gettime(CLOCK_MONOTONIC, &decodeFinish);
+        if (image == NULL) {
+            fprintf(stderr, "Could not read '%s'.\n", imageInName);
+            exit(EXIT_FAILURE);
+        }
+        pitch = width * 4;
+        double decodeTime = (decodeFinish.tv_sec - decodeStart.tv_sec) + (decodeFinish.tv_nsec - decodeStart.tv_nsec) / 1000000000.0;
+        printf("Branje slike: %f sekund (%.1f Mpx/s)\n", decodeTime, (double)width * height / decodeTime / 1e6);
+    } else {
+        image = load_image_file(imageInName, &width, &height, &pitch);
+        if (image == NULL) {
+            fprintf(stderr, "Could not load image '%s'.\n", imageInName);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    unsigned char *image = (unsigned char *)malloc(height * pitch * sizeof(unsigned char));
-	FreeImage_ConvertToRawBits(image, imageBitmap32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+    // Palette output keeps the centroids and the cluster index of every pixel instead of rebuilding the image
+    unsigned char *palette = savedPalette;
+    unsigned char *indices = NULL;
+    if (palette == NULL && (palettePng || kmcOutput || pngLevel >= 0 || trainScale > 1 || numberOfLevels > 1 || tileSize > 0 || paletteOut != NULL || cacheDir != NULL)) {
+        palette = (unsigned char *)malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    }
+    if (palettePng || kmcOutput) {
+        indices = (unsigned char *)malloc((size_t)width * height * sizeof(unsigned char));
+    }
 
     struct timespec start, finish;
     clock_gettime(CLOCK_MONOTONIC, &start);
     
+    // Palette cache: an identical signature skips training, a close one warm-starts it (or is applied with --cache-apply)
+    unsigned short *signature = NULL;
+    enum CacheResult cacheResult = CACHE_MISS;
+    double cacheDistance = 0;
+    if (cacheDir != NULL) {
+        signature = malloc(PALETTE_CACHE_BINS * sizeof(unsigned short));
+        palette_cache_signature(image, (size_t)width * height, signature);
+        cacheResult = palette_cache_lookup(cacheDir, signature, numberOfClusters, cacheMaxDistance, palette, &cacheDistance);
+        if (cacheResult == CACHE_NEAR && !cacheApply && maxShift < 0) {
+            maxShift = 0;
+        }
+    }
+    int applyOnly = savedPalette != NULL || cacheResult == CACHE_HIT || (cacheResult == CACHE_NEAR && cacheApply);
+    if (applyOnly && !assignGiven) {
+        assignMode = ASSIGN_LUT;
+    }
+
     // Image compression using k-means clustering algorithm
-    kmeans_sequential(image, width, height, numberOfClusters, numberOfIterations);
+    long long inertia;
+    if (applyOnly) {
+        inertia = apply_palette(image, width, height, palette, numberOfClusters, indices);
+    } else if (numberOfLevels > 1) {
+        inertia = kmeans_pyramid(image, width, height, pitch, numberOfClusters, numberOfIterations, numberOfLevels, refineIterations, palette, indices);
+    } else if (tileSize > 0) {
+        inertia = kmeans_tiled(image, width, height, pitch, numberOfClusters, numberOfIterations, tileSize, palette, indices);
+    } else if (trainScale > 1) {
+        // Centroids are trained on a reduced copy, only the final assignment runs at full resolution
+        int trainWidth, trainHeight;
+        unsigned char *trainImage = load_training_image(imageInName, image, width, height, pitch, trainScale, &trainWidth, &trainHeight);
+        kmeans_sequential(trainImage, trainWidth, trainHeight, numberOfClusters, numberOfIterations, palette, NULL, 0);
+        inertia = apply_palette(image, width, height, palette, numberOfClusters, indices);
+        free(trainImage);
+    } else {
+        inertia = kmeans_sequential(image, width, height, numberOfClusters, numberOfIterations, palette, indices, cacheResult == CACHE_NEAR);
+    }
+    if (cacheDir != NULL && !applyOnly && !palette_cache_store(cacheDir, signature, palette, numberOfClusters)) {
+        fprintf(stderr, "Could not store the palette in '%s'.\n", cacheDir);
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &finish);
     double elapsed = (finish.tv_sec - start.tv_sec);
     elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
 
     printf("Čas izvajanja programa: %f sekund\n", elapsed);
+    printf("Inercija: %lld\n", inertia);
+    printf("PSNR: %.2f dB\n", 10.0 * log10(255.0 * 255.0 * 3.0 * width * height / (inertia > 0 ? inertia : 1)));
+    if (distanceEvaluations > 0) {
+        printf("Izračunov razdalje na vzorec: %.2f\n", (double)distanceEvaluations / assignedSamples);
+    }
+    if ((maxShift >= 0 || timeBudgetMs >= 0) && !applyOnly) {
+        printf("Iteracije: %lld / %d%s\n", iterationsRun, numberOfIterations,
+               budgetExhausted ? " (časovna omejitev)" : iterationsRun < numberOfIterations ? " (konvergenca)" : "");
+    }
+    if (cacheDir != NULL) {
+        long long counters[3];
+        palette_cache_counters(cacheDir, counters);
+        if (cacheResult == CACHE_MISS) {
+            printf("Predpomnilnik palet: zgrešitev");
+        } else {
+            printf("Predpomnilnik palet: %s (razdalja %.4f)", cacheResult == CACHE_HIT ? "zadetek" : "bližnji zadetek", cacheDistance);
+        }
+        printf(", skupaj %lld zadetkov, %lld bližnjih, %lld zgrešitev\n", counters[CACHE_HIT], counters[CACHE_NEAR], counters[CACHE_MISS]);
+    }
+    if (paletteOut != NULL && !palette_save(paletteOut, palette, numberOfClusters, width, height, numberOfIterations, inertia)) {
+        fprintf(stderr, "Could not save palette '%s'.\n", paletteOut);
+    }
 
     // Save output image
-    FIBITMAP *dst = FreeImage_ConvertFromRawBits(image, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-	FreeImage_Save(FIF_PNG, dst, imageOutName, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int saved;
+    if (kmcOutput) {
+        saved = kmc_write(imageOutName, indices, 1, palette, numberOfClusters, width, height);
+    } else if (pngLevel >= 0) {
+        // Parallel encoder on a background thread, the palette is printed in the meantime
+        struct PngJob job = {.fileName = imageOutName, .data = palettePng ? indices : image, .width = width, .height = height,
+                             .pitch = palettePng ? width : pitch, .palette = palettePng ? palette : NULL,
+                             .numberOfColors = numberOfClusters, .level = pngLevel};
+        png_save_async(&job);
+        print_palette(palette, numberOfClusters);
+        saved = png_save_wait(&job);
+    } else if (palettePng) {
+        saved = save_palette_png(imageOutName, indices, palette, numberOfClusters, width, height);
+    } else {
+        saved = save_rgba_png(imageOutName, image, width, height, pitch);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (saved) {
+        print_output_stats(imageOutName, (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0, (long long)width * height);
+    } else {
+        fprintf(stderr, "Could not save image '%s'.\n", imageOutName);
+    }
+
+    // Round trip: the written KMC file must decode to exactly the palette and indices that were encoded
+    int roundTrip = 1;
+    if (kmcOutput && saved) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        roundTrip = kmc_verify(imageOutName, indices, 1, palette, numberOfClusters, width, height);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double decodeTime = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        printf("Branje slike: %f sekund (%.1f Mpx/s), %s\n", decodeTime, (double)width * height / decodeTime / 1e6, roundTrip ? "enako zapisanemu" : "RAZLIKA");
+        if (!roundTrip) {
+            fprintf(stderr, "'%s' does not decode to the encoded palette and indices.\n", imageOutName);
+        }
+    }
+    if (timeBudgetMs >= 0) {
+        printf("Skupni čas: %.0f ms (omejitev %d ms)\n", seconds_since(programStart) * 1000.0, timeBudgetMs);
+    }
 
     // Cleanup
     free(image);
+    free(palette);
+    free(indices);
+    free(signature);
+    free(positional);
 
-    return 0;
+    return roundTrip ? 0 : EXIT_FAILURE;
 }
 
 
-void kmeans_sequential(unsigned char *image, int width, int height, int numberOfClusters, int numberOfIterations) {
+long long kmeans_sequential(unsigned char *image, int width, int height, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices, int warmStart) {
+    // Filtering algorithm over the unique colours replaces the per-sample iterations
+    if (assignMode == ASSIGN_FILTER) {
+        return kmeans_filtering(image, width, height, numberOfClusters, numberOfIterations, palette, indices, warmStart);
+    }
+
     unsigned char *centroids = malloc(numberOfClusters * 4 * sizeof(char));   // Array of centroids
-    int *c = malloc(width * height * sizeof(int));                          // Array to store indexes of centroids nearest to corresponding samples
-    int *sum = malloc(numberOfClusters * 4 * sizeof(int));                    // Array to store sum of RGBA values for each cluster
-    int *n = malloc(numberOfClusters * sizeof(int));                          // Array to store number of elements in each cluster
+    int *c = malloc((size_t)width * height * sizeof(int));                    // Array to store indexes of centroids nearest to corresponding samples
+    long long *sum = malloc(numberOfClusters * 4 * sizeof(long long));        // Array to store sum of RGBA values for each cluster
+    long long *n = malloc(numberOfClusters * sizeof(long long));              // Array to store number of elements in each cluster
+    long long inertia = 0;                                                    // Sum of squared distances of the last assignment
+    struct CentroidTree tree = {0};                                           // Centroid index for --assign kdtree
+    struct PdeIndex pde = {0};                                                // Sorted centroids for --assign pde
+    struct PaletteLut lut = {0};                                              // Colour lookup table for --assign lut
+    unsigned char *bestCentroids = NULL;                                      // Centroids with the lowest measured inertia (--time-budget-ms)
+    long long bestInertia = -1;                                               // Inertia of bestCentroids
+    size_t bestIteration = 0, lastIteration = 0;                              // Iterations that measured bestCentroids and ran last
+    double iterationTime = 0;                                                 // Duration of the last iteration in seconds
+    double reserve = (double)width * height * TIME_BUDGET_RESERVE_NS / 1e9;   // Time kept for rebuilding and saving
 
     // Initialize values
     #pragma omp parallel for
     for (size_t i = 0; i < numberOfClusters * 4; i += 4) {
-        int max = width * height;
-        int min = 0;
-        int r = random_integer(min, max) * 4;
-        
-        // Set centroid value to random sample
-        centroids[i + 0] = image[r + 0];
-        centroids[i + 1] = image[r + 1];
-        centroids[i + 2] = image[r + 2];
-        centroids[i + 3] = image[r + 3];
+        if (warmStart) {
+            // Continue from the given palette
+            centroids[i + 0] = palette[i + 0];
+            centroids[i + 1] = palette[i + 1];
+            centroids[i + 2] = palette[i + 2];
+            centroids[i + 3] = palette[i + 3];
+        } else {
+            int max = (long long)width * height < RAND_MAX ? width * height : RAND_MAX;
+            int min = 0;
+            size_t r = (size_t)random_integer(min, max) * 4;
+
+            // Set centroid value to random sample
+            centroids[i + 0] = image[r + 0];
+            centroids[i + 1] = image[r + 1];
+            centroids[i + 2] = image[r + 2];
+            centroids[i + 3] = image[r + 3];
+        }
 
         // Set centroid sum to zero
         sum[i + 0] = 0;
@@ -90,12 +474,43 @@ void kmeans_sequential(unsigned char *image, int width, int height, int numberOf
         n[i / 4] = 0;
     }
 
+    if (timeBudgetMs >= 0) {
+        bestCentroids = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    }
+
     for (size_t i = 0; i < numberOfIterations; i++) {
+        // Stop before an iteration that, as long as the last one, would leave no time to rebuild and save the image
+        if (timeBudgetMs >= 0 && i > 0 && seconds_since(programStart) + iterationTime + reserve > timeBudgetMs / 1000.0) {
+            budgetExhausted = 1;
+            break;
+        }
+        struct timespec iterationStart;
+        clock_gettime(CLOCK_MONOTONIC, &iterationStart);
+        lastIteration = i;
+        inertia = 0;
+
+        // Rebuild the centroid index for the current centroids
+        if (assignMode == ASSIGN_KDTREE) {
+            centroid_tree_build(&tree, centroids, numberOfClusters);
+        } else if (assignMode == ASSIGN_PDE || assignMode == ASSIGN_COHERENT) {
+            pde_build(&pde, centroids, numberOfClusters);
+        } else if (assignMode == ASSIGN_LUT) {
+            palette_lut_build(&lut, centroids, numberOfClusters, image[3]);
+        }
+        assignedSamples += (long long)width * height;
+
+        // The blocked and coherent kernels assign all samples at once, the loop below only accumulates the sums
+        if (assignMode == ASSIGN_GEMM) {
+            inertia = gemm_assign(image, (size_t)width * height, centroids, numberOfClusters, c);
+        } else if (assignMode == ASSIGN_COHERENT) {
+            inertia = coherent_assign(image, width, height, centroids, &pde, c, i > 0, &distanceEvaluations);
+        }
+
         // For every sample
-        #pragma omp parallel for
-        for (size_t j = 0; j < (width * height); j++) {
+        #pragma omp parallel for reduction(+ : inertia, distanceEvaluations)
+        for (size_t j = 0; j < ((size_t)width * height); j++) {
             int nearestCentroidIndex = 0;
-            int base = j * 4;
+            size_t base = j * 4;
 
             // Image sample values
             unsigned char i_r = image[base + 0];
@@ -103,34 +518,55 @@ void kmeans_sequential(unsigned char *image, int width, int height, int numberOf
             unsigned char i_b = image[base + 2];
             unsigned char i_a = image[base + 3];
 
-            // Centroid sample values
-            unsigned char c_r = centroids[0];
-            unsigned char c_g = centroids[1];
-            unsigned char c_b = centroids[2];
-            unsigned char c_a = centroids[3];
+            int minDeviation;
+            if (assignMode == ASSIGN_GEMM) {
+                // Distances are already counted in inertia
+                nearestCentroidIndex = c[j] * 4;
+                minDeviation = 0;
+            } else if (assignMode == ASSIGN_COHERENT) {
+                nearestCentroidIndex = c[j];
+                minDeviation = 0;
+            } else if (assignMode == ASSIGN_KDTREE) {
+                // Exact search from the centroid of the previous iteration
+                nearestCentroidIndex = centroid_tree_nearest(&tree, image + base, i > 0 ? c[j] / 4 : -1, &minDeviation) * 4;
+            } else if (assignMode == ASSIGN_PDE) {
+                nearestCentroidIndex = pde_nearest(&pde, image + base, i > 0 ? c[j] / 4 : -1, -1, centroids, &minDeviation, &distanceEvaluations) * 4;
+            } else if (assignMode == ASSIGN_LUT) {
+                nearestCentroidIndex = palette_lut_nearest(&lut, image + base, &minDeviation, &distanceEvaluations) * 4;
+            } else {
+                distanceEvaluations += numberOfClusters;
+
+                // Centroid sample values
+                unsigned char c_r = centroids[0];
+                unsigned char c_g = centroids[1];
+                unsigned char c_b = centroids[2];
+                unsigned char c_a = centroids[3];
 
 
-            // Set minimal deviation as distance between first two samples
-            int minDeviation = pow(i_r - c_r, 2.0) + pow(i_g - c_g, 2.0) + pow(i_b - c_b, 2.0) + pow(i_a - c_a, 2.0);
+                // Set minimal deviation as distance between first two samples
+                minDeviation = pow(i_r - c_r, 2.0) + pow(i_g - c_g, 2.0) + pow(i_b - c_b, 2.0) + pow(i_a - c_a, 2.0);
 
-            // Loop through centroids
-            for (size_t k = 4; k < numberOfClusters * 4; k += 4) {
-                c_r = centroids[k + 0];
-                c_g = centroids[k + 1];
-                c_b = centroids[k + 2];
-                c_a = centroids[k + 3];
+                // Loop through centroids
+                for (size_t k = 4; k < numberOfClusters * 4; k += 4) {
+                    c_r = centroids[k + 0];
+                    c_g = centroids[k + 1];
+                    c_b = centroids[k + 2];
+                    c_a = centroids[k + 3];
                 
-                // Find eucledian distance between two samples (deviation between two colors)
-                int deviation = pow(i_r - c_r, 2.0) + pow(i_g - c_g, 2.0) + pow(i_b - c_b, 2.0) + pow(i_a - c_a, 2.0);
+                    // Find eucledian distance between two samples (deviation between two colors)
+                    int deviation = pow(i_r - c_r, 2.0) + pow(i_g - c_g, 2.0) + pow(i_b - c_b, 2.0) + pow(i_a - c_a, 2.0);
 
-                // Update minimal deviation and index of second sample if new deviation is smaller than minimal deviation
-                if (deviation < minDeviation) {
-                    minDeviation = deviation;
-                    nearestCentroidIndex = k;
+                    // Update minimal deviation and index of second sample if new deviation is smaller than minimal deviation
+                    if (deviation < minDeviation) {
+                        minDeviation = deviation;
+                        nearestCentroidIndex = k;
+                    }
                 }
             }
+
             // At this point we have found cetroid nearest to pointA, so we store its index at corresponding position
             c[j] = nearestCentroidIndex;
+            inertia += minDeviation;
 
             // Because we added one more sample to the cluster, we need to add it's RGBA values to the existing sum
             #pragma omp atomic update
@@ -147,17 +583,26 @@ void kmeans_sequential(unsigned char *image, int width, int height, int numberOf
             n[nearestCentroidIndex / 4]++;
         }
 
+        // inertia belongs to the centroids before this update, so those are the ones worth keeping
+        if (bestCentroids != NULL && (bestInertia < 0 || inertia < bestInertia)) {
+            memcpy(bestCentroids, centroids, numberOfClusters * 4 * sizeof(unsigned char));
+            bestInertia = inertia;
+            bestIteration = i;
+        }
+
+        int shift = 0;
+
         // Loop through centroids to calculate average sample value
-        #pragma omp parallel for
+        #pragma omp parallel for reduction(max : shift)
         for (size_t j = 0; j < numberOfClusters * 4; j += 4) {
             // centroids array is 4 times longer than n, so we need to normalize index
             int normalizedIndex = j / 4;
 
             // If there is no elements in the cluster, we append one random sample
             if (n[normalizedIndex] == 0) {
-                int max = width * height;
+                int max = (long long)width * height < RAND_MAX ? width * height : RAND_MAX;
                 int min = 0;
-                int r = random_integer(min, max) * 4;
+                size_t r = (size_t)random_integer(min, max) * 4;
                 sum[j + 0] = image[r + 0];
                 sum[j + 1] = image[r + 1];
                 sum[j + 2] = image[r + 2];
@@ -165,37 +610,601 @@ void kmeans_sequential(unsigned char *image, int width, int height, int numberOf
                 n[normalizedIndex]++;
             }
 
+            // Largest change of a centroid channel, for the convergence check
+            for (int channel = 0; channel < 4; channel++) {
+                int change = abs((int)(sum[j + channel] / n[normalizedIndex]) - centroids[j + channel]);
+                shift = change > shift ? change : shift;
+            }
+
             // Set centroid RGBA values by dividing it's sum by corresponding number of elements inside cluster
             centroids[j + 0] = sum[j + 0] / n[normalizedIndex];
             centroids[j + 1] = sum[j + 1] / n[normalizedIndex];
             centroids[j + 2] = sum[j + 2] / n[normalizedIndex];
             centroids[j + 3] = sum[j + 3] / n[normalizedIndex];
+
+            // Clear sums for the next iteration
+            sum[j + 0] = 0;
+            sum[j + 1] = 0;
+            sum[j + 2] = 0;
+            sum[j + 3] = 0;
+            n[normalizedIndex] = 0;
+        }
+
+        iterationsRun++;
+        iterationTime = seconds_since(iterationStart);
+        if (maxShift >= 0 && shift <= maxShift) {
+            break;
         }
     }
 
-    // Rebuild image using centroid data
-    #pragma omp parallel for
-    for (size_t i = 0; i < (width * height); i++) {
-        // Index of centroid nearest to current point i
-        int nearestCentroidIndex = c[i];
-        unsigned char r = centroids[nearestCentroidIndex + 0];
-        unsigned char g = centroids[nearestCentroidIndex + 1];
-        unsigned char b = centroids[nearestCentroidIndex + 2];
-        unsigned char a = centroids[nearestCentroidIndex + 3];
-
-        // Image has 4 color channels, so we need to normalize current index by multiplying i by 4
-        int imagePointIndex = i * 4;
-        image[imagePointIndex + 0] = r;
-        image[imagePointIndex + 1] = g;
-        image[imagePointIndex + 2] = b;
-        image[imagePointIndex + 3] = a;
+    // With a time budget the best measured centroids are the result; c only holds their assignment if they came from the last iteration
+    int reassign = 0;
+    if (bestCentroids != NULL) {
+        memcpy(centroids, bestCentroids, numberOfClusters * 4 * sizeof(unsigned char));
+        inertia = bestInertia;
+        reassign = bestIteration != lastIteration;
+    }
+
+    // Centroids become the palette and cluster indices the pixels of the output image
+    if (palette != NULL) {
+        memcpy(palette, centroids, numberOfClusters * 4 * sizeof(unsigned char));
+    }
+    if (reassign) {
+        inertia = apply_palette(image, width, height, centroids, numberOfClusters, indices);
+    } else if (indices != NULL) {
+        #pragma omp parallel for
+        for (size_t i = 0; i < ((size_t)width * height); i++) {
+            indices[i] = c[i] / 4;
+        }
+    } else {
+        // Rebuild image using centroid data
+        #pragma omp parallel for
+        for (size_t i = 0; i < ((size_t)width * height); i++) {
+            // Index of centroid nearest to current point i
+            int nearestCentroidIndex = c[i];
+            unsigned char r = centroids[nearestCentroidIndex + 0];
+            unsigned char g = centroids[nearestCentroidIndex + 1];
+            unsigned char b = centroids[nearestCentroidIndex + 2];
+            unsigned char a = centroids[nearestCentroidIndex + 3];
+
+            // Image has 4 color channels, so we need to normalize current index by multiplying i by 4
+            size_t imagePointIndex = i * 4;
+            image[imagePointIndex + 0] = r;
+            image[imagePointIndex + 1] = g;
+            image[imagePointIndex + 2] = b;
+            image[imagePointIndex + 3] = a;
+        }
     }
     
     // Cleanup
     free(centroids);
     free(c);
+    centroid_tree_free(&tree);
+    pde_free(&pde);
+    palette_lut_free(&lut);
+    free(bestCentroids);
     free(sum);
     free(n);
+
+    return inertia;
+}
+
+
+/**
+ *   @brief Assigns every sample to the nearest palette colour
+ *
+ *   @param image raw image data, rebuilt from the palette if indices is NULL
+ *   @param width image width
+ *   @param height image height
+ *   @param palette centroids, 4 bytes each in the byte order of the image
+ *   @param numberOfClusters number of centroids
+ *   @param indices palette index of every sample (k <= 256) or NULL
+ *
+ *   @return Sum of squared distances between the samples and their palette colours (inertia)
+ */
+long long apply_palette(unsigned char *image, int width, int height, unsigned char *palette, int numberOfClusters, unsigned char *indices) {
+    long long inertia = 0;
+    struct CentroidTree tree = {0};
+    struct PdeIndex pde = {0};
+    struct PaletteLut lut = {0};
+    int *nearest = NULL;
+    if (assignMode == ASSIGN_GEMM) {
+        nearest = malloc((size_t)width * height * sizeof(int));
+        gemm_assign(image, (size_t)width * height, palette, numberOfClusters, nearest);
+    } else if (assignMode == ASSIGN_COHERENT) {
+        // coherent_assign stores 4 * index, the layout of c in kmeans_sequential
+        nearest = malloc((size_t)width * height * sizeof(int));
+        pde_build(&pde, palette, numberOfClusters);
+        coherent_assign(image, width, height, palette, &pde, nearest, 0, &distanceEvaluations);
+    } else if (assignMode == ASSIGN_PDE) {
+        pde_build(&pde, palette, numberOfClusters);
+    } else if (assignMode == ASSIGN_LUT) {
+        palette_lut_build(&lut, palette, numberOfClusters, image[3]);
+    } else if (assignMode != ASSIGN_BRUTE) {
+        centroid_tree_build(&tree, palette, numberOfClusters);
+    }
+    assignedSamples += (long long)width * height;
+
+    #pragma omp parallel for reduction(+ : inertia, distanceEvaluations)
+    for (size_t i = 0; i < ((size_t)width * height); i++) {
+        size_t base = i * 4;
+        int nearestCentroidIndex = 0;
+        int minDeviation = -1;
+
+        if (nearest != NULL) {
+            nearestCentroidIndex = assignMode == ASSIGN_COHERENT ? nearest[i] : nearest[i] * 4;
+            minDeviation = color_distance(image + base, palette + nearestCentroidIndex);
+        } else if (assignMode == ASSIGN_PDE) {
+            nearestCentroidIndex = pde_nearest(&pde, image + base, -1, -1, palette, &minDeviation, &distanceEvaluations) * 4;
+        } else if (assignMode == ASSIGN_LUT) {
+            nearestCentroidIndex = palette_lut_nearest(&lut, image + base, &minDeviation, &distanceEvaluations) * 4;
+        } else if (assignMode != ASSIGN_BRUTE) {
+            nearestCentroidIndex = centroid_tree_nearest(&tree, image + base, -1, &minDeviation) * 4;
+        } else {
+            distanceEvaluations += numberOfClusters;
+            for (int k = 0; k < numberOfClusters * 4; k += 4) {
+                int deviation = (image[base + 0] - palette[k + 0]) * (image[base + 0] - palette[k + 0]) +
+                                (image[base + 1] - palette[k + 1]) * (image[base + 1] - palette[k + 1]) +
+                                (image[base + 2] - palette[k + 2]) * (image[base + 2] - palette[k + 2]) +
+                                (image[base + 3] - palette[k + 3]) * (image[base + 3] - palette[k + 3]);
+                if (minDeviation < 0 || deviation < minDeviation) {
+                    minDeviation = deviation;
+                    nearestCentroidIndex = k;
+                }
+            }
+        }
+        inertia += minDeviation;
+
+        if (indices != NULL) {
+            indices[i] = nearestCentroidIndex / 4;
+        } else {
+            image[base + 0] = palette[nearestCentroidIndex + 0];
+            image[base + 1] = palette[nearestCentroidIndex + 1];
+            image[base + 2] = palette[nearestCentroidIndex + 2];
+            image[base + 3] = palette[nearestCentroidIndex + 3];
+        }
+    }
+
+    free(nearest);
+    pde_free(&pde);
+    palette_lut_free(&lut);
+    centroid_tree_free(&tree);
+
+    return inertia;
+}
+
+
+/**
+ *   @brief K-means with the filtering algorithm over a kd-tree of the unique colours (--assign filter)
+ *
+ *   Every iteration assigns whole subtrees of colours to a centroid at once (subtrees near the root run as
+ *   OpenMP tasks); the final assignment of every sample uses the centroid kd-tree.
+ *
+ *   @param image raw image data, rebuilt from the centroids if indices is NULL
+ *   @param width image width
+ *   @param height image height
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations number of iterations
+ *   @param palette centroids after the last iteration or NULL (initial centroids if warmStart)
+ *   @param indices cluster index of every sample (k <= 256) or NULL
+ *   @param warmStart start from the centroids in palette instead of random samples
+ *
+ *   @return Sum of squared distances of the final assignment (inertia)
+ */
+long long kmeans_filtering(unsigned char *image, int width, int height, int numberOfClusters, int numberOfIterations, unsigned char *palette, unsigned char *indices, int warmStart) {
+    unsigned char *centroids = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+
+    for (int k = 0; k < numberOfClusters; k++) {
+        if (warmStart) {
+            memcpy(centroids + k * 4, palette + k * 4, 4);
+        } else {
+            int max = (long long)width * height < RAND_MAX ? width * height : RAND_MAX;
+            memcpy(centroids + k * 4, image + (size_t)random_integer(0, max) * 4, 4);
+        }
+    }
+
+    struct ColorTree tree;
+    color_tree_build(&tree, image, (size_t)width * height);
+    int numberOfIterationsRun;
+    filtering_kmeans(&tree, centroids, numberOfClusters, numberOfIterations, maxShift, &numberOfIterationsRun);
+    iterationsRun += numberOfIterationsRun;
+    color_tree_free(&tree);
+
+    if (palette != NULL) {
+        memcpy(palette, centroids, numberOfClusters * 4 * sizeof(unsigned char));
+    }
+    long long inertia = apply_palette(image, width, height, centroids, numberOfClusters, indices);
+
+    free(centroids);
+    return inertia;
+}
+
+
+/**
+ *   @brief Returns the image halved in both directions, every sample is the average of a 2x2 block
+ *
+ *   @param image raw image data
+ *   @param width image width
+ *   @param height image height
+ *   @param pitch bytes per row of image
+ *   @param outWidth width of the reduced image, set on return
+ *   @param outHeight height of the reduced image, set on return
+ *
+ *   @return Raw data of the reduced image (caller frees), rows are outWidth * 4 bytes
+ */
+unsigned char *downsample(unsigned char *image, int width, int height, int pitch, int *outWidth, int *outHeight) {
+    int reducedWidth = width / 2 > 0 ? width / 2 : 1;
+    int reducedHeight = height / 2 > 0 ? height / 2 : 1;
+    unsigned char *reduced = malloc((size_t)reducedWidth * reducedHeight * 4 * sizeof(unsigned char));
+
+    #pragma omp parallel for
+    for (int y = 0; y < reducedHeight; y++) {
+        // Odd last rows and columns are dropped, single rows and columns are repeated
+        unsigned char *top = image + (size_t)(2 * y < height ? 2 * y : height - 1) * pitch;
+        unsigned char *bottom = image + (size_t)(2 * y + 1 < height ? 2 * y + 1 : height - 1) * pitch;
+
+        for (int x = 0; x < reducedWidth; x++) {
+            int left = (2 * x < width ? 2 * x : width - 1) * 4;
+            int right = (2 * x + 1 < width ? 2 * x + 1 : width - 1) * 4;
+
+            for (int channel = 0; channel < 4; channel++) {
+                reduced[((size_t)y * reducedWidth + x) * 4 + channel] =
+                    (top[left + channel] + top[right + channel] + bottom[left + channel] + bottom[right + channel] + 2) / 4;
+            }
+        }
+    }
+
+    *outWidth = reducedWidth;
+    *outHeight = reducedHeight;
+    return reduced;
+}
+
+
+/**
+ *   @brief Coarse-to-fine k-means over an image pyramid
+ *
+ *   Runs all iterations on the coarsest level, refineIterations on every finer level starting from the
+ *   centroids of the level below, and one assignment pass at full resolution.
+ *
+ *   @param image raw image data, rebuilt from the palette if indices is NULL
+ *   @param width image width
+ *   @param height image height
+ *   @param pitch bytes per row of image
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations iterations on the coarsest level
+ *   @param numberOfLevels number of levels including full resolution
+ *   @param refineIterations iterations on every finer level
+ *   @param palette final centroids, set on return
+ *   @param indices palette index of every sample (k <= 256) or NULL
+ *
+ *   @return Inertia of the full resolution assignment
+ */
+long long kmeans_pyramid(unsigned char *image, int width, int height, int pitch, int numberOfClusters, int numberOfIterations, int numberOfLevels, int refineIterations, unsigned char *palette, unsigned char *indices) {
+    unsigned char **levels = malloc(numberOfLevels * sizeof(unsigned char *));
+    int *levelWidth = malloc(numberOfLevels * sizeof(int));
+    int *levelHeight = malloc(numberOfLevels * sizeof(int));
+
+    // Build the pyramid, stop early once a level would have fewer samples than clusters
+    levels[0] = image;
+    levelWidth[0] = width;
+    levelHeight[0] = height;
+    int usedLevels = 1;
+    while (usedLevels < numberOfLevels && (levelWidth[usedLevels - 1] / 2) * (levelHeight[usedLevels - 1] / 2) >= numberOfClusters) {
+        int l = usedLevels;
+        levels[l] = downsample(levels[l - 1], levelWidth[l - 1], levelHeight[l - 1], l == 1 ? pitch : levelWidth[l - 1] * 4, &levelWidth[l], &levelHeight[l]);
+        usedLevels++;
+    }
+
+    // Coarsest level from random centroids, finer levels continue from the centroids found so far
+    for (int l = usedLevels - 1; l >= 1; l--) {
+        int warmStart = l < usedLevels - 1;
+        kmeans_sequential(levels[l], levelWidth[l], levelHeight[l], numberOfClusters, warmStart ? refineIterations : numberOfIterations, palette, NULL, warmStart);
+    }
+
+    // Final assignment at full resolution (plain k-means if the image is too small for a pyramid)
+    long long inertia;
+    if (usedLevels == 1) {
+        inertia = kmeans_sequential(image, width, height, numberOfClusters, numberOfIterations, palette, indices, 0);
+    } else {
+        inertia = apply_palette(image, width, height, palette, numberOfClusters, indices);
+    }
+
+    for (int l = 1; l < usedLevels; l++) {
+        free(levels[l]);
+    }
+    free(levels);
+    free(levelWidth);
+    free(levelHeight);
+
+    return inertia;
+}
+
+
+/**
+ *   @brief Weighted k-means over a list of samples
+ *
+ *   @param samples RGBA samples, 4 bytes each
+ *   @param weights weight of every sample or NULL for weight 1
+ *   @param numberOfSamples number of samples
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations number of iterations
+ *   @param palette centroids, set on return
+ *   @param counts total weight assigned to every centroid after the last update or NULL
+ *   @param seed seed of the generator that picks the initial centroids (rand_r), so concurrent calls do not share state
+ */
+void kmeans_weighted(unsigned char *samples, long long *weights, int numberOfSamples, int numberOfClusters, int numberOfIterations, unsigned char *palette, long long *counts, unsigned int seed) {
+    long long *sum = malloc(numberOfClusters * 5 * sizeof(long long));          // Weighted RGBA sums followed by the weight of every cluster
+    long long *n = sum + numberOfClusters * 4;
+
+    // Random samples with non-zero weight as initial centroids
+    for (int k = 0; k < numberOfClusters; k++) {
+        int r = rand_r(&seed) % numberOfSamples;
+        for (int tries = 0; weights != NULL && weights[r] == 0 && tries < numberOfSamples; tries++) {
+            r = (r + 1) % numberOfSamples;
+        }
+        memcpy(palette + k * 4, samples + (size_t)r * 4, 4);
+    }
+
+    // The last pass only fills in counts for the final centroids
+    for (int i = 0; i <= numberOfIterations; i++) {
+        memset(sum, 0, numberOfClusters * 5 * sizeof(long long));
+
+        for (int j = 0; j < numberOfSamples; j++) {
+            unsigned char *sample = samples + (size_t)j * 4;
+            long long weight = weights != NULL ? weights[j] : 1;
+            int nearestCentroidIndex = 0;
+            int minDeviation = -1;
+
+            for (int k = 0; k < numberOfClusters * 4; k += 4) {
+                int deviation = (sample[0] - palette[k + 0]) * (sample[0] - palette[k + 0]) +
+                                (sample[1] - palette[k + 1]) * (sample[1] - palette[k + 1]) +
+                                (sample[2] - palette[k + 2]) * (sample[2] - palette[k + 2]) +
+                                (sample[3] - palette[k + 3]) * (sample[3] - palette[k + 3]);
+                if (minDeviation < 0 || deviation < minDeviation) {
+                    minDeviation = deviation;
+                    nearestCentroidIndex = k;
+                }
+            }
+
+            sum[nearestCentroidIndex + 0] += sample[0] * weight;
+            sum[nearestCentroidIndex + 1] += sample[1] * weight;
+            sum[nearestCentroidIndex + 2] += sample[2] * weight;
+            sum[nearestCentroidIndex + 3] += sample[3] * weight;
+            n[nearestCentroidIndex / 4] += weight;
+        }
+
+        if (i == numberOfIterations) {
+            break;
+        }
+
+        // Clusters without samples keep their centroid
+        for (int k = 0; k < numberOfClusters; k++) {
+            if (n[k] > 0) {
+                for (int channel = 0; channel < 4; channel++) {
+                    palette[k * 4 + channel] = sum[k * 4 + channel] / n[k];
+                }
+            }
+        }
+    }
+
+    if (counts != NULL) {
+        memcpy(counts, n, numberOfClusters * sizeof(long long));
+    }
+    free(sum);
+}
+
+
+/**
+ *   @brief Two-level k-means: independent k-means in every tile, then a merge of the tile centroids
+ *
+ *   Every tile of tileSize x tileSize samples is clustered on its own (tiles run in parallel, with no
+ *   synchronization between iterations). The tile centroids, weighted by the number of samples
+ *   they hold, are clustered into the global palette and one assignment pass runs at full resolution.
+ *
+ *   @param image raw image data, rebuilt from the palette if indices is NULL
+ *   @param width image width
+ *   @param height image height
+ *   @param pitch bytes per row of image
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations iterations in every tile and in the merge
+ *   @param tileSize tile width and height in samples
+ *   @param palette final centroids, set on return
+ *   @param indices palette index of every sample (k <= 256) or NULL
+ *
+ *   @return Inertia of the full resolution assignment
+ */
+long long kmeans_tiled(unsigned char *image, int width, int height, int pitch, int numberOfClusters, int numberOfIterations, int tileSize, unsigned char *palette, unsigned char *indices) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    int numberOfTiles = tilesX * tilesY;
+    unsigned char *tileCentroids = malloc((size_t)numberOfTiles * numberOfClusters * 4 * sizeof(unsigned char));
+    long long *tileCounts = malloc((size_t)numberOfTiles * numberOfClusters * sizeof(long long));
+    unsigned int seed = rand();                                                 // Tile t is seeded with seed + t, independent of the thread that runs it
+
+    #pragma omp parallel
+    {
+        unsigned char *tile = malloc((size_t)tileSize * tileSize * 4 * sizeof(unsigned char));
+
+        #pragma omp for schedule(dynamic)
+        for (int t = 0; t < numberOfTiles; t++) {
+            int x0 = (t % tilesX) * tileSize;
+            int y0 = (t / tilesX) * tileSize;
+            int tileWidth = x0 + tileSize < width ? tileSize : width - x0;
+            int tileHeight = y0 + tileSize < height ? tileSize : height - y0;
+
+            // Copy the tile rows into one contiguous block
+            for (int y = 0; y < tileHeight; y++) {
+                memcpy(tile + (size_t)y * tileWidth * 4, image + (size_t)(y0 + y) * pitch + x0 * 4, tileWidth * 4);
+            }
+            kmeans_weighted(tile, NULL, tileWidth * tileHeight, numberOfClusters, numberOfIterations,
+                            tileCentroids + (size_t)t * numberOfClusters * 4, tileCounts + (size_t)t * numberOfClusters, seed + t);
+        }
+
+        free(tile);
+    }
+
+    // Global palette from the weighted tile centroids
+    kmeans_weighted(tileCentroids, tileCounts, numberOfTiles * numberOfClusters, numberOfClusters, numberOfIterations, palette, NULL, seed + numberOfTiles);
+    long long inertia = apply_palette(image, width, height, palette, numberOfClusters, indices);
+
+    free(tileCentroids);
+    free(tileCounts);
+
+    return inertia;
+}
+
+
+/**
+ *   @brief Clusters a sequence of frames, every frame starting from the centroids of the previous one
+ *
+ *   Iterations of a frame stop once no centroid channel moves by more than maxShift, so warm-started frames
+ *   usually need only a few of them.
+ *
+ *   @param outputDirectory directory for the output frames, which keep the input file names
+ *   @param inputNames input frames in sequence order
+ *   @param numberOfFrames number of frames
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations maximum number of iterations per frame
+ *   @param palettePng write 8-bit palette PNGs instead of RGBA images
+ *   @param coldStart start every frame from random samples instead (for comparison)
+ *
+ *   @return Number of frames that could not be loaded or saved
+ */
+int kmeans_sequence(const char *outputDirectory, char **inputNames, int numberOfFrames, int numberOfClusters, int numberOfIterations, int palettePng, int coldStart) {
+    unsigned char *palette = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    char outputName[4096];
+    int failed = 0;
+    int clustered = 0;
+    long long numberOfPixels = 0;
+    double clusterTime = 0;
+
+    for (int f = 0; f < numberOfFrames; f++) {
+        int width, height, pitch;
+        unsigned char *image = load_image_file(inputNames[f], &width, &height, &pitch);
+        if (image == NULL) {
+            fprintf(stderr, "Could not load image '%s'.\n", inputNames[f]);
+            failed++;
+            continue;
+        }
+        unsigned char *indices = palettePng ? malloc((size_t)width * height * sizeof(unsigned char)) : NULL;
+
+        // The palette of the previous frame is the starting point of this one
+        long long iterationsBefore = iterationsRun;
+        struct timespec start, finish;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long inertia = kmeans_sequential(image, width, height, numberOfClusters, numberOfIterations, palette, indices, clustered > 0 && !coldStart);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        clusterTime += elapsed;
+        numberOfPixels += (long long)width * height;
+        clustered++;
+
+        const char *baseName = strrchr(inputNames[f], '/') != NULL ? strrchr(inputNames[f], '/') + 1 : inputNames[f];
+        snprintf(outputName, sizeof(outputName), "%s/%s", outputDirectory, baseName);
+        int saved = palettePng ? save_palette_png(outputName, indices, palette, numberOfClusters, width, height) : save_rgba_png(outputName, image, width, height, pitch);
+        if (!saved) {
+            fprintf(stderr, "Could not save image '%s'.\n", outputName);
+            failed++;
+        }
+        printf("%s: %lld iteracij, %f sekund, PSNR %.2f dB\n", baseName, iterationsRun - iterationsBefore, elapsed,
+               10.0 * log10(255.0 * 255.0 * 3.0 * width * height / (inertia > 0 ? inertia : 1)));
+
+        free(image);
+        free(indices);
+    }
+
+    if (clustered > 0) {
+        printf("Sličice: %d, povprečno iteracij na sličico: %.2f\n", clustered, (double)iterationsRun / clustered);
+        printf("Čas izvajanja programa: %f sekund (%.1f Mpx/s)\n", clusterTime, numberOfPixels / clusterTime / 1e6);
+    }
+
+    free(palette);
+    return failed;
+}
+
+
+/**
+ *   @brief Decodes a KMC file into an image without clustering
+ *
+ *   Every pixel gets the palette entry of its stored index, so the output holds exactly the pixels that were
+ *   encoded. With palettePng the palette and indices are written as they are (at most 256 colours).
+ *
+ *   @param inputName KMC file name
+ *   @param outputName output image name
+ *   @param palettePng write an 8-bit palette PNG instead of an RGBA image
+ *   @param pngLevel compression level of the built-in PNG encoder, -1 to save with FreeImage
+ *
+ *   @return 1 if the output image was saved, 0 otherwise
+ */
+int decode_kmc(const char *inputName, const char *outputName, int palettePng, int pngLevel) {
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int width, height, numberOfColors;
+    unsigned char *palette;
+    unsigned short *indices = kmc_read_indices(inputName, &width, &height, &palette, &numberOfColors);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (indices == NULL) {
+        fprintf(stderr, "Could not read '%s'.\n", inputName);
+        return 0;
+    }
+    double decodeTime = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("Branje slike: %f sekund (%.1f Mpx/s)\n", decodeTime, (double)width * height / decodeTime / 1e6);
+    if (palettePng && numberOfColors > 256) {
+        fprintf(stderr, "--palette-png needs at most 256 colours, '%s' has %d.\n", inputName, numberOfColors);
+        free(indices);
+        free(palette);
+        return 0;
+    }
+
+    // Palette output keeps the stored indices, otherwise every index is expanded to its BGRA entry
+    size_t numberOfPixels = (size_t)width * height;
+    unsigned char *data = malloc(numberOfPixels * (palettePng ? 1 : 4));
+    #pragma omp parallel for
+    for (size_t i = 0; i < numberOfPixels; i++) {
+        if (palettePng) {
+            data[i] = indices[i];
+        } else {
+            memcpy(data + i * 4, palette + indices[i] * 4, 4);
+        }
+    }
+    free(indices);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int saved;
+    if (pngLevel >= 0) {
+        struct PngJob job = {.fileName = outputName, .data = data, .width = width, .height = height, .pitch = palettePng ? width : width * 4,
+                             .palette = palettePng ? palette : NULL, .numberOfColors = numberOfColors, .level = pngLevel};
+        png_save_async(&job);
+        print_palette(palette, numberOfColors);
+        saved = png_save_wait(&job);
+    } else {
+        print_palette(palette, numberOfColors);
+        saved = palettePng ? save_palette_png(outputName, data, palette, numberOfColors, width, height) : save_rgba_png(outputName, data, width, height, width * 4);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (saved) {
+        print_output_stats(outputName, (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0, (long long)numberOfPixels);
+    } else {
+        fprintf(stderr, "Could not save image '%s'.\n", outputName);
+    }
+
+    free(data);
+    free(palette);
+    return saved;
+}
+
+
+/**
+ *   @brief Returns the time elapsed since a point in time
+ *
+ *   @param start CLOCK_MONOTONIC time
+ *
+ *   @return Elapsed time in seconds
+ */
+double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
 }
 
 
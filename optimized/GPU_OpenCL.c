@@ -2,56 +2,264 @@
 #include <stdlib.h>
 #include <string.h>
 #include "FreeImage.h"
+#include "palette_png.h"
+#include "kmc.h"
+#include "image_load.h"
 #include <math.h>
 #include <CL/cl.h>
 #include <time.h>
 
 #define WORKGROUP_SIZE 16
 #define MAX_SOURCE_SIZE 16384
+#define MAX_CACHED_PROGRAMS 16
+#define TIME_BUDGET_RESERVE_NS 100      // Estimated readback and PNG encoding time per pixel, kept free at the end
 
 struct Point
 {
     int r, g, b, a;
 };
 
+// Enqueued command with the event used for profiling (iteration is -1 outside the main loop)
+struct Command
+{
+    const char *name;
+    int iteration;
+    cl_event event;
+};
+
+// Program compiled for one (k, channels) pair; k = 0 marks the generic program
+struct CachedProgram
+{
+    int k, channels;
+    cl_program program;
+};
+
+struct CachedProgram programCache[MAX_CACHED_PROGRAMS];
+int numberOfCachedPrograms = 0;
+
+// Settings shared by every image of a run
+struct Settings
+{
+    int numberOfClusters, numberOfIterations;
+    int specialize, indexReadback, palettePng;
+    int poll, checkInterval;
+    int coexec;
+    int pngLevel;
+    double deviceShare;
+    double tolerance;
+    int timeBudgetMs;
+    const char *cacheDir;
+    ulong randomSeed;
+};
+
+// Queue, device buffers and host state for one image in flight; batch mode cycles through several slots
+struct Slot
+{
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel initializeValues_kernel, arrangeInClusters_kernel, updateCentroidValues_kernel, rebuildImage_kernel, packIndices_kernel;
+    size_t maxWorkGroupSize;
+    cl_mem image_d, centroids_d, c_d, sum_d, n_d, changed_d, inertia_d, history_d, indices_d;
+    size_t capacity;
+
+    int busy;
+    char outName[512];
+    int width, height, pitch, threshold;
+    unsigned char *image;
+    struct Point *centroids;
+    void *indices;
+    int *changed, *checkIterations, *checkCommands;
+    cl_uint *inertiaSums;
+    int numberOfEnqueued, budgetExhausted;
+    long long inertia;
+    struct Command *commands;
+    int numberOfCommands;
+    struct timespec start;
+};
+
 cl_int status;
+struct timespec programStart;
+
+void check_status(cl_int status, const char *operation);
+const char *device_type_name(cl_device_type type);
+void list_devices(void);
+int select_device(const char *deviceSpec, cl_platform_id *platform, cl_device_id *device);
+void print_device_info(cl_device_id device);
+void expand_indices(unsigned char *image, const void *indices, int indexSize, struct Point *centroids, int numberOfPixels);
+cl_event *record_command(struct Command *commands, int *numberOfCommands, const char *name, int iteration);
+int image_channels(unsigned char *image, int numberOfPixels);
+cl_program get_program(cl_context context, cl_device_id device, const char *source, int k, int channels, const char *cacheDir);
+void write_profile_json(const char *fileName, struct Command *commands, int numberOfCommands, int numberOfIterations, double elapsed);
+int load_image(struct Slot *slot, const char *imageName);
+void prepare_slot(struct Slot *slot, cl_context context, cl_device_id device, const char *source, struct Settings *settings);
+void set_kernel_args(struct Slot *slot, struct Settings *settings);
+void enqueue_image(struct Slot *slot, struct Settings *settings);
+void coexecute_image(struct Slot *slot, struct Settings *settings);
+int host_arrange_in_clusters(unsigned char *image, int first, int last, struct Point *centroids, int numberOfClusters, int *c, struct Point *sum, int *n, long long *inertia);
+int nearest_centroid(const unsigned char *pixel, struct Point *centroids, int numberOfClusters, int *deviation);
+int finish_image(struct Slot *slot, struct Settings *settings, const char *profileName);
+void release_slot(struct Slot *slot);
+int iterations_run(struct Slot *slot);
+double seconds_since(struct timespec start);
 
 int main(int argc, const char *argv[])
 {
-
+    clock_gettime(CLOCK_MONOTONIC, &programStart);
     srandom(time(NULL));
-    ulong randomSeed = random();
 
-    char imageName[100];
-    char imageOutName[100];
-    int numberOfClusters = 0;
-    int numberOfIterations = 0;
+    struct Settings settings = {0};
+    settings.randomSeed = random();
+    settings.specialize = 1;
+    settings.checkInterval = 4;
+    settings.poll = 1;
+    settings.deviceShare = 0.5;
+    settings.pngLevel = -1;
+    settings.timeBudgetMs = -1;
+    const char *deviceSpec = "gpu";
+    const char *profileName = NULL;
+    int batch = 0;
+    int numberOfSlots = 3;
+    const char **positional = malloc(argc * sizeof(char *));
+    int numberOfPositional = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cl-list") == 0)
+        {
+            list_devices();
+            exit(EXIT_SUCCESS);
+        }
+        else if (strcmp(argv[i], "--cl-device") == 0 && i + 1 < argc)
+        {
+            deviceSpec = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profileName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cl-generic") == 0)
+        {
+            settings.specialize = 0;
+        }
+        else if (strcmp(argv[i], "--cl-cache") == 0 && i + 1 < argc)
+        {
+            settings.cacheDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            settings.tolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--check-interval") == 0 && i + 1 < argc)
+        {
+            settings.checkInterval = atoi(argv[++i]);
+            if (settings.checkInterval < 1)
+                settings.checkInterval = 1;
+        }
+        else if (strcmp(argv[i], "--time-budget-ms") == 0 && i + 1 < argc)
+        {
+            settings.timeBudgetMs = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+        }
+        else if (strcmp(argv[i], "--readback") == 0 && i + 1 < argc)
+        {
+            settings.indexReadback = strcmp(argv[++i], "index") == 0;
+        }
+        else if (strcmp(argv[i], "--palette-png") == 0)
+        {
+            settings.palettePng = 1;
+            settings.indexReadback = 1;
+        }
+        else if (strcmp(argv[i], "--coexec") == 0)
+        {
+            settings.coexec = 1;
+        }
+        else if (strcmp(argv[i], "--device-share") == 0 && i + 1 < argc)
+        {
+            settings.deviceShare = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc)
+        {
+            settings.pngLevel = atoi(argv[++i]) < 9 ? atoi(argv[i]) : 9;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = 1;
+        }
+        else if (strcmp(argv[i], "--queues") == 0 && i + 1 < argc)
+        {
+            numberOfSlots = atoi(argv[++i]);
+            if (numberOfSlots < 1)
+                numberOfSlots = 1;
+        }
+        else if (strncmp(argv[i], "--", 2) != 0)
+        {
+            positional[numberOfPositional++] = argv[i];
+        }
+        else
+        {
+            numberOfPositional = -1;
+            break;
+        }
+    }
 
-    if (argc != 5)
+    if (batch ? numberOfPositional < 4 : numberOfPositional != 4)
     {
-        printf("USAGE: ./GPU_OpenCL input_image output_image number_of_clusters number_of_iterations\n");
+        printf("USAGE: ./GPU_OpenCL input_image output_image number_of_clusters number_of_iterations [options]\n");
+        printf("       ./GPU_OpenCL --batch output_dir number_of_clusters number_of_iterations input_image... [--queues n] [options]\n");
+        printf("options: [--cl-device type[:platform[:index]]] [--cl-list] [--profile profile.json] [--cl-generic] [--cl-cache dir] [--tolerance fraction] [--check-interval n] [--time-budget-ms ms] [--readback image|index] [--palette-png] [--coexec] [--device-share fraction] [--png-level 0-9]\n");
+        printf("Input and output names ending in .kmc are read and written as KMC files.\n");
         exit(EXIT_SUCCESS);
     }
 
-    sprintf(imageName, "%s", argv[1]);
-    sprintf(imageOutName, "%s", argv[2]);
-    numberOfClusters = atoi(argv[3]);
-    numberOfIterations = atoi(argv[4]);
+    // V paketnem načinu so prvi trije argumenti izhodna mapa, k in število iteracij, nato sledijo vhodne slike
+    const char **inputNames = batch ? &positional[3] : &positional[0];
+    int numberOfImages = batch ? numberOfPositional - 3 : 1;
+    settings.numberOfClusters = atoi(positional[batch ? 1 : 2]);
+    settings.numberOfIterations = atoi(positional[batch ? 2 : 3]);
 
-    // Load image from file
-    FIBITMAP *imageBitmap = FreeImage_Load(FIF_PNG, imageName, PNG_DEFAULT);
-    FIBITMAP *imageBitmap32 = FreeImage_ConvertTo32Bits(imageBitmap);
+    if (settings.palettePng && settings.numberOfClusters > 256)
+    {
+        fprintf(stderr, "--palette-png needs at most 256 clusters.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Get image dimensions
-    int width = FreeImage_GetWidth(imageBitmap32);
-    int height = FreeImage_GetHeight(imageBitmap32);
-    int pitch = FreeImage_GetPitch(imageBitmap32);
+    // KMC izhod (.kmc) potrebuje indekse gruč; v paketnem načinu izhodi obdržijo imena vhodov
+    for (int i = 0; i < (batch ? numberOfPositional - 3 : 1); i++)
+    {
+        if (kmc_is_kmc(batch ? positional[3 + i] : positional[1]))
+            settings.indexReadback = 1;
+    }
 
-    // Preapare room for a raw data copy of the image
-    size_t imageSize = height * pitch * sizeof(char);
+    if (settings.coexec && (batch || settings.indexReadback))
+    {
+        fprintf(stderr, "--coexec works on a single image and rebuilds it on the host, so it excludes --batch and index readback.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.timeBudgetMs >= 0)
+    {
+        if (batch)
+        {
+            fprintf(stderr, "--time-budget-ms works on a single image and excludes --batch.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Čas iteracije merimo z zaporedjem ukazov, preverjamo pa vsako iteracijo
+        settings.checkInterval = 1;
+    }
 
-    unsigned char *image = malloc(imageSize);
-    FreeImage_ConvertToRawBits(image, imageBitmap32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+    if (batch)
+    {
+        // Gostitelj ne čaka na preverjanja konvergence, da lahko medtem nalaga naslednje slike
+        settings.poll = 0;
+        if (profileName)
+            fprintf(stderr, "--profile is ignored in batch mode.\n");
+        profileName = NULL;
+    }
+    else
+    {
+        numberOfSlots = 1;
+    }
+    if (numberOfSlots > numberOfImages)
+        numberOfSlots = numberOfImages;
 
     FILE *fp = fopen("kernel.cl", "r");
     if (!fp)
@@ -62,35 +270,298 @@ int main(int argc, const char *argv[])
 
     // Zapiši Kernel v RAM
     char *source_str = (char *)malloc(MAX_SOURCE_SIZE);
-    size_t source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
+    size_t source_size = fread(source_str, 1, MAX_SOURCE_SIZE - 1, fp);
     source_str[source_size] = '\0';
     fclose(fp);
 
-    // Podatki o platformi
-    cl_platform_id platform_id[10];
-    cl_uint num_platforms;
-    status = clGetPlatformIDs(10, platform_id, &num_platforms); // Max. število platform, kazalec na platforme, dejansko število platform
+    // Podatki o platformi in napravi
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+    if (!select_device(deviceSpec, &platform_id, &device_id))
+    {
+        fprintf(stderr, "No OpenCL device matches '%s'. Available devices:\n", deviceSpec);
+        list_devices();
+        exit(EXIT_FAILURE);
+    }
+    print_device_info(device_id);
 
-    // Podatki o napravi
-    cl_device_id device_id[10];
-    cl_uint num_devices;
-    // Delali bomo s platform_id[0] na GPU
-    status = clGetDeviceIDs(platform_id[0], CL_DEVICE_TYPE_GPU, 10, device_id, &num_devices);
-    // izbrana platforma, tip naprave, koliko naprav nas zanima
-    // kazalec na naprave, dejansko število naprav
+    // Lokalni pomnilnik mora sprejeti delne vsote in števce za vse gruče
+    cl_ulong localMemSize;
+    status = clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, NULL);
+    check_status(status, "clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)");
+    if (settings.numberOfClusters * (sizeof(struct Point) + sizeof(int)) > localMemSize)
+    {
+        fprintf(stderr, "%d clusters need %zu bytes of local memory, device has %llu.\n", settings.numberOfClusters,
+                settings.numberOfClusters * (sizeof(struct Point) + sizeof(int)), (unsigned long long)localMemSize);
+        exit(EXIT_FAILURE);
+    }
 
     // Kontekst
-    cl_context context = clCreateContext(NULL, 1, &device_id[0], NULL, NULL, &status);
+    cl_context context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &status);
+    check_status(status, "clCreateContext");
     // kontekst: vkljucene platforme - NULL je privzeta, število naprav,
     // kazalci na naprave, kazalec na call-back funkcijo v primeru napake
     // dodatni parametri funkcije, številka napake
 
-    // Ukazna vrsta
-    cl_command_queue commandQueue = clCreateCommandQueue(context, device_id[0], 0, &status);
-    // kontekst, naprava, INORDER/OUTOFORDER, napake
+    // Vsaka reža ima svojo ukazno vrsto in svoje medpomnilnike, tako da se prenos slike N+1 in
+    // branje slike N-1 prekrivata z gručenjem slike N
+    struct Slot *slots = calloc(numberOfSlots, sizeof(struct Slot));
+    for (int s = 0; s < numberOfSlots; s++)
+    {
+        // Ukazna vrsta
+        cl_command_queue_properties queueProperties = profileName || settings.coexec || settings.timeBudgetMs >= 0 ? CL_QUEUE_PROFILING_ENABLE : 0;
+        slots[s].queue = clCreateCommandQueue(context, device_id, queueProperties, &status);
+        check_status(status, "clCreateCommandQueue");
+        // kontekst, naprava, INORDER/OUTOFORDER (+ profiliranje), napake
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int processed = 0;
+
+    for (int n = 0; n < numberOfImages + numberOfSlots; n++)
+    {
+        struct Slot *slot = &slots[n % numberOfSlots];
+
+        // Najprej zaključimo sliko, ki je bila prej v tej reži
+        if (slot->busy)
+        {
+            processed += finish_image(slot, &settings, profileName);
+        }
+
+        if (n >= numberOfImages)
+            continue;
+
+        if (!load_image(slot, inputNames[n]))
+        {
+            fprintf(stderr, "Could not load image '%s'.\n", inputNames[n]);
+            if (!batch)
+                exit(EXIT_FAILURE);
+            continue;
+        }
+
+        if (batch)
+        {
+            const char *baseName = strrchr(inputNames[n], '/') ? strrchr(inputNames[n], '/') + 1 : inputNames[n];
+            snprintf(slot->outName, sizeof(slot->outName), "%s/%s", positional[0], baseName);
+        }
+        else
+        {
+            snprintf(slot->outName, sizeof(slot->outName), "%s", positional[1]);
+        }
+
+        prepare_slot(slot, context, device_id, source_str, &settings);
+        if (settings.coexec)
+            coexecute_image(slot, &settings);
+        else
+            enqueue_image(slot, &settings);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double elapsed = (finish.tv_sec - start.tv_sec);
+    elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    if (batch)
+        printf("Obdelanih slik: %d v %f sekundah (%.2f slik/s)\n", processed, elapsed, processed / elapsed);
+
+    // Cleanup
+    for (int s = 0; s < numberOfSlots; s++)
+        release_slot(&slots[s]);
+    free(slots);
+    for (int i = 0; i < numberOfCachedPrograms; i++)
+        status |= clReleaseProgram(programCache[i].program);
+    status |= clReleaseContext(context);
+    check_status(status, "cleanup");
+
+    free(source_str);
+    free(positional);
+
+    return 0;
+}
+
+
+/**
+ *   @brief Loads an image into the host buffer of a slot
+ *
+ *   @param slot slot that will process the image
+ *   @param imageName input file name
+ *
+ *   @return 1 if the image was loaded, 0 otherwise
+ */
+int load_image(struct Slot *slot, const char *imageName)
+{
+    // KMC files are decoded on the host
+    if (kmc_is_kmc(imageName))
+    {
+        struct timespec decodeStart, decodeFinish;
+        clock_gettime(CLOCK_MONOTONIC, &decodeStart);
+        int width, height;
+        unsigned char *image = kmc_read(imageName, &width, &height);
+        clock_gettime(CLOCK_MONOTONIC, &decodeFinish);
+        if (!image)
+            return 0;
+
+        double decodeTime = (decodeFinish.tv_sec - decodeStart.tv_sec) + (decodeFinish.tv_nsec - decodeStart.tv_nsec) / 1000000000.0;
+        printf("%s: Branje slike: %f sekund (%.1f Mpx/s)\n", imageName, decodeTime, (double)width * height / decodeTime / 1e6);
+        free(slot->image);
+        slot->image = image;
+        slot->width = width;
+        slot->height = height;
+        slot->pitch = width * 4;
+        return 1;
+    }
+
+    // Load image from file (PNG, JPEG, TIFF, BMP, WebP, PPM, ...)
+    int width, height, pitch;
+    unsigned char *image = load_image_file(imageName, &width, &height, &pitch);
+    if (!image)
+        return 0;
+
+    free(slot->image);
+    slot->image = image;
+    slot->width = width;
+    slot->height = height;
+    slot->pitch = pitch;
+    return 1;
+}
+
+
+/**
+ *   @brief Makes sure the device buffers and kernels of a slot fit the loaded image
+ *
+ *   Buffers only grow, so a batch of equally sized images allocates them once.
+ *
+ *   @param slot slot with a loaded image
+ *   @param context OpenCL context
+ *   @param device selected device
+ *   @param source kernel source code
+ *   @param settings settings of the run
+ */
+void prepare_slot(struct Slot *slot, cl_context context, cl_device_id device, const char *source, struct Settings *settings)
+{
+    int numberOfClusters = settings->numberOfClusters;
+    int numberOfIterations = settings->numberOfIterations;
+    size_t numberOfPixels = (size_t)slot->width * slot->height;
+    size_t imageSize = slot->height * slot->pitch * sizeof(char);
+    int indexSize = numberOfClusters <= 256 ? 1 : 2;
+
+    clock_gettime(CLOCK_MONOTONIC, &slot->start);
+
+    // Alokacija pomnilnika na napravi
+    if (!slot->centroids_d)
+    {
+        slot->centroids_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(struct Point), NULL, &status);
+        check_status(status, "clCreateBuffer(centroids)");
+        slot->sum_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(struct Point), NULL, &status);
+        check_status(status, "clCreateBuffer(sum)");
+        slot->n_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(int), NULL, &status);
+        check_status(status, "clCreateBuffer(n)");
+        slot->changed_d = clCreateBuffer(context, CL_MEM_READ_WRITE, (numberOfIterations + 1) * sizeof(int), NULL, &status);
+        check_status(status, "clCreateBuffer(changed)");
+        slot->inertia_d = clCreateBuffer(context, CL_MEM_READ_WRITE, 2 * (numberOfIterations + 1) * sizeof(cl_uint), NULL, &status);
+        check_status(status, "clCreateBuffer(inertia)");
+        // Centroidi vseh iteracij, da lahko pri časovni omejitvi vrnemo najboljše
+        slot->history_d = NULL;
+        if (settings->timeBudgetMs >= 0)
+        {
+            slot->history_d = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)numberOfIterations * numberOfClusters * sizeof(struct Point), NULL, &status);
+            check_status(status, "clCreateBuffer(history)");
+        }
+
+        slot->centroids = malloc(numberOfClusters * sizeof(struct Point));
+        slot->changed = calloc(numberOfIterations + 1, sizeof(int));
+        slot->inertiaSums = calloc(2 * (numberOfIterations + 1), sizeof(cl_uint));
+        slot->checkIterations = malloc((numberOfIterations + 1) * sizeof(int));
+        slot->checkCommands = malloc((numberOfIterations + 1) * sizeof(int));
+        // Dogodki vseh ukazov: prenos slike, inicializacija, do 7 ukazov na iteracijo (skupno izvajanje), rekonstrukcija, branje
+        slot->commands = malloc((7 * numberOfIterations + 10) * sizeof(struct Command));
+    }
+
+    if (numberOfPixels > slot->capacity)
+    {
+        if (slot->image_d)
+        {
+            status = clReleaseMemObject(slot->image_d);
+            status |= clReleaseMemObject(slot->c_d);
+            if (slot->indices_d)
+                status |= clReleaseMemObject(slot->indices_d);
+            check_status(status, "clReleaseMemObject");
+        }
+
+        slot->image_d = clCreateBuffer(context, CL_MEM_READ_WRITE, imageSize, NULL, &status);
+        check_status(status, "clCreateBuffer(image)");
+        slot->c_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfPixels * sizeof(int), NULL, &status);
+        check_status(status, "clCreateBuffer(c)");
+
+        // Kompaktni indeksi gruč (1 bajt za k <= 256, sicer 2) v pomnilniku, ki ga gostitelj preslika brez kopiranja na CPU napravah
+        slot->indices_d = NULL;
+        if (settings->indexReadback)
+        {
+            slot->indices_d = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, numberOfPixels * indexSize, NULL, &status);
+            check_status(status, "clCreateBuffer(indices)");
+        }
+        slot->capacity = numberOfPixels;
+    }
+
+    // Priprava programa, specializiranega za število gruč in kanalov (k = 0 je splošna različica)
+    // Pri skupnem izvajanju gostitelj vedno sešteva alfo, zato mora tudi naprava
+    int channels = settings->coexec ? 4 : image_channels(slot->image, numberOfPixels);
+    cl_program program = get_program(context, device, source, settings->specialize ? numberOfClusters : 0, settings->specialize ? channels : 4, settings->cacheDir);
+
+    if (program != slot->program)
+    {
+        if (slot->program)
+        {
+            status = clReleaseKernel(slot->initializeValues_kernel);
+            status |= clReleaseKernel(slot->arrangeInClusters_kernel);
+            status |= clReleaseKernel(slot->updateCentroidValues_kernel);
+            status |= clReleaseKernel(slot->rebuildImage_kernel);
+            status |= clReleaseKernel(slot->packIndices_kernel);
+            check_status(status, "clReleaseKernel");
+        }
+
+        // Ščepec: priprava objekta
+        slot->initializeValues_kernel = clCreateKernel(program, "initialize_values", &status);
+        slot->arrangeInClusters_kernel = clCreateKernel(program, "arrange_in_clusters", &status);
+        slot->updateCentroidValues_kernel = clCreateKernel(program, "update_centroid_values", &status);
+        slot->rebuildImage_kernel = clCreateKernel(program, "rebuild_image", &status);
+        slot->packIndices_kernel = clCreateKernel(program, indexSize == 1 ? "pack_indices" : "pack_indices16", &status);
+        check_status(status, "clCreateKernel");
+        slot->program = program;
+
+        // Delitev dela (CPU naprave imajo lahko manjše delovne skupine)
+        status = clGetKernelWorkGroupInfo(slot->arrangeInClusters_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &slot->maxWorkGroupSize, NULL);
+        check_status(status, "clGetKernelWorkGroupInfo");
+    }
+}
+
+
+/**
+ *   @brief Enqueues upload, clustering and readback of the image in a slot
+ *
+ *   Iterations are enqueued ahead. Unless the run is a batch, every checkInterval iterations the number
+ *   of moved samples is read back without blocking, and enqueueing stops once convergence is seen. The
+ *   host only waits when it is more than 2 * checkInterval iterations ahead of the oldest check.
+ *   Iterations enqueued past convergence return immediately on the device. With a time budget the
+ *   completed checks also give the average iteration time, enqueueing stops once the queued iterations
+ *   would end too late to read back and save the image, and the centroids of the iteration with the
+ *   lowest inertia are the result.
+ *
+ *   @param slot prepared slot with a loaded image
+ *   @param settings settings of the run
+ */
+void enqueue_image(struct Slot *slot, struct Settings *settings)
+{
+    cl_command_queue commandQueue = slot->queue;
+    int numberOfClusters = settings->numberOfClusters;
+    int numberOfIterations = settings->numberOfIterations;
+    int width = slot->width;
+    int height = slot->height;
+    size_t imageSize = height * slot->pitch * sizeof(char);
+    int indexSize = numberOfClusters <= 256 ? 1 : 2;
 
     // Delitev dela na podlagi velikosti vhodne slike
-    const size_t localItemSize1 = 256;
+    const size_t localItemSize1 = slot->maxWorkGroupSize < 256 ? slot->maxWorkGroupSize : 256;
     const size_t num_groups1 = (((width * height) - 1) / localItemSize1 + 1);
     const size_t globalItemSize1 = num_groups1 * localItemSize1;
 
@@ -99,134 +570,1211 @@ int main(int argc, const char *argv[])
     const size_t num_groups2 = ((numberOfClusters - 1) / localItemSize2 + 1);
     const size_t globalItemSize2 = num_groups2 * localItemSize2;
 
-    struct timespec start, finish;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Konvergenca: iteracija, v kateri se premakne največ threshold vzorcev, je zadnja
+    slot->threshold = settings->tolerance * width * height;
 
-    // Alokacija pomnilnika na napravi
-    cl_mem image_d = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, imageSize, image, &status);
-    cl_mem centroids_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(struct Point), NULL, &status);
-    cl_mem c_d = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * sizeof(int), NULL, &status);
-    cl_mem sum_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(struct Point), NULL, &status);
-    cl_mem n_d = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfClusters * sizeof(int), NULL, &status);
-
-    // Priprava programa
-    cl_program program = clCreateProgramWithSource(context, 1, (const char **)&source_str, NULL, &status);
-    // kontekst, število kazalcev na kodo, kazalci na kodo,
-    // stringi so NULL terminated, napaka
-
-    // Prevajanje
-    status = clBuildProgram(program, 1, &device_id[0], NULL, NULL, NULL);
-    // program, število naprav, lista naprav, opcije pri prevajanju,
-    // kazalec na funkcijo, uporabniski argumenti
-
-    // Log
-    size_t build_log_len;
-    char *build_log;
-    status = clGetProgramBuildInfo(program, device_id[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len);
-    // program, naprava, tip izpisa,
-    // maksimalna dolžina niza, kazalec na niz, dejanska dolžina niza
-    build_log = (char *)malloc(sizeof(char) * (build_log_len + 1));
-    status = clGetProgramBuildInfo(program, device_id[0], CL_PROGRAM_BUILD_LOG, build_log_len, build_log, NULL);
-    printf("%s\n", build_log);
-    free(build_log);
-
-    // Ščepec: priprava objekta
-    cl_kernel initializeValues_kernel = clCreateKernel(program, "initialize_values", &status);
-    cl_kernel arrangeInClusters_kernel = clCreateKernel(program, "arrange_in_clusters", &status);
-    cl_kernel updateCentroidValues_kernel = clCreateKernel(program, "update_centroid_values", &status);
-    cl_kernel rebuildImage_kernel = clCreateKernel(program, "rebuild_image", &status);
+    set_kernel_args(slot, settings);
+    int numberOfPixels = width * height;
 
-    // Ščepec: argumenti
-    status = clSetKernelArg(initializeValues_kernel, 0, sizeof(cl_mem), (void *)&image_d);
-    status |= clSetKernelArg(initializeValues_kernel, 1, sizeof(cl_int), (void *)&width);
-    status |= clSetKernelArg(initializeValues_kernel, 2, sizeof(cl_int), (void *)&height);
-    status |= clSetKernelArg(initializeValues_kernel, 3, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(initializeValues_kernel, 4, sizeof(cl_int), (void *)&numberOfClusters);
-    status |= clSetKernelArg(initializeValues_kernel, 5, sizeof(ulong), (void *)&randomSeed);
-
-    status |= clSetKernelArg(arrangeInClusters_kernel, 0, sizeof(cl_mem), (void *)&image_d);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 1, sizeof(cl_int), (void *)&width);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 2, sizeof(cl_int), (void *)&height);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 3, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 4, sizeof(cl_mem), (void *)&c_d);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 5, sizeof(cl_mem), (void *)&sum_d);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 6, sizeof(cl_mem), (void *)&n_d);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 7, sizeof(cl_int), (void *)&numberOfClusters);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 8, numberOfClusters * sizeof(struct Point), NULL);
-    status |= clSetKernelArg(arrangeInClusters_kernel, 9, numberOfClusters * sizeof(int), NULL);
-
-    status |= clSetKernelArg(updateCentroidValues_kernel, 0, sizeof(cl_mem), (void *)&image_d);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 1, sizeof(cl_int), (void *)&width);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 2, sizeof(cl_int), (void *)&height);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 3, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 4, sizeof(cl_mem), (void *)&sum_d);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 5, sizeof(cl_mem), (void *)&n_d);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 6, sizeof(cl_int), (void *)&numberOfClusters);
-    status |= clSetKernelArg(updateCentroidValues_kernel, 7, sizeof(ulong), (void *)&randomSeed);
-
-    status |= clSetKernelArg(rebuildImage_kernel, 0, sizeof(cl_mem), (void *)&image_d);
-    status |= clSetKernelArg(rebuildImage_kernel, 1, sizeof(cl_int), (void *)&width);
-    status |= clSetKernelArg(rebuildImage_kernel, 2, sizeof(cl_int), (void *)&height);
-    status |= clSetKernelArg(rebuildImage_kernel, 3, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(rebuildImage_kernel, 4, sizeof(cl_mem), (void *)&c_d);
-    // ščepec, številka argumenta, velikost podatkov, kazalec na podatke
+    struct Command *commands = slot->commands;
+    slot->numberOfCommands = 0;
+
+    // Prenos slike na napravo, začetne vsote so 0, dodelitve pa -1, da prva iteracija šteje vse vzorce kot premaknjene
+    const cl_int zero = 0, none = -1;
+    status = clEnqueueFillBuffer(commandQueue, slot->sum_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(struct Point), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->n_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(int), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->changed_d, &zero, sizeof(cl_int), 0, (numberOfIterations + 1) * sizeof(int), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->inertia_d, &zero, sizeof(cl_int), 0, 2 * (numberOfIterations + 1) * sizeof(cl_uint), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->c_d, &none, sizeof(cl_int), 0, numberOfPixels * sizeof(int), 0, NULL, NULL);
+    check_status(status, "clEnqueueFillBuffer");
+    status = clEnqueueWriteBuffer(commandQueue, slot->image_d, CL_FALSE, 0, imageSize, slot->image, 0, NULL,
+                                  record_command(commands, &slot->numberOfCommands, "write_image", -1));
+    check_status(status, "clEnqueueWriteBuffer(image)");
 
-    cl_event *events;
     // Ščepec: zagon
-    status = clEnqueueNDRangeKernel(commandQueue, initializeValues_kernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL, NULL);
+    status = clEnqueueNDRangeKernel(commandQueue, slot->initializeValues_kernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL,
+                                    record_command(commands, &slot->numberOfCommands, "initialize_values", -1));
+    check_status(status, "clEnqueueNDRangeKernel(initialize_values)");
     // vrsta, ščepec, dimenzionalnost, mora biti NULL,
     // kazalec na število vseh niti, kazalec na lokalno število niti,
     // dogodki, ki se morajo zgoditi pred klicem
 
-    for (size_t i = 0; i < numberOfIterations; i++)
+    int *changed = slot->changed;
+    int *checkIterations = slot->checkIterations;
+    int *checkCommands = slot->checkCommands;
+    int numberOfChecks = 0;
+    int firstPendingCheck = 0;
+    int converged = 0;
+    int firstIterationCommand = slot->numberOfCommands;
+    const int checkInterval = settings->checkInterval;
+    const int lookahead = 2 * checkInterval;
+    memset(changed, 0, (numberOfIterations + 1) * sizeof(int));
+
+    // Časovna omejitev: povprečni čas iteracije iz profilnih podatkov končanih preverjanj
+    double iterationTime = 0;
+    int completedIterations = 0;
+    double reserve = (double)numberOfPixels * TIME_BUDGET_RESERVE_NS / 1e9;
+    slot->numberOfEnqueued = 0;
+    slot->budgetExhausted = 0;
+    slot->inertia = -1;
+
+    for (int i = 0; i < numberOfIterations && !converged; i++)
     {
-        status = clEnqueueNDRangeKernel(commandQueue, arrangeInClusters_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL, NULL);
-        status = clEnqueueNDRangeKernel(commandQueue, updateCentroidValues_kernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL, NULL);
+        // Ustavimo se, če bi se čakajoče iteracije in ta končale prepozno za branje in zapis slike
+        if (settings->timeBudgetMs >= 0 && iterationTime > 0 &&
+            seconds_since(programStart) + (i + 1 - completedIterations) * iterationTime + reserve > settings->timeBudgetMs / 1000.0)
+        {
+            slot->budgetExhausted = 1;
+            break;
+        }
+
+        status = clSetKernelArg(slot->arrangeInClusters_kernel, 9, sizeof(cl_int), (void *)&i);
+        status |= clSetKernelArg(slot->updateCentroidValues_kernel, 9, sizeof(cl_int), (void *)&i);
+        check_status(status, "clSetKernelArg(iteration)");
+
+        status = clEnqueueNDRangeKernel(commandQueue, slot->arrangeInClusters_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL,
+                                        record_command(commands, &slot->numberOfCommands, "arrange_in_clusters", i));
+        check_status(status, "clEnqueueNDRangeKernel(arrange_in_clusters)");
+        status = clEnqueueNDRangeKernel(commandQueue, slot->updateCentroidValues_kernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL,
+                                        record_command(commands, &slot->numberOfCommands, "update_centroid_values", i));
+        check_status(status, "clEnqueueNDRangeKernel(update_centroid_values)");
+        slot->numberOfEnqueued++;
+
+        if (!settings->poll)
+            continue;
+
+        if ((i + 1) % checkInterval == 0 && i + 1 < numberOfIterations)
+        {
+            checkIterations[numberOfChecks] = i;
+            checkCommands[numberOfChecks] = slot->numberOfCommands;
+            numberOfChecks++;
+            status = clEnqueueReadBuffer(commandQueue, slot->changed_d, CL_FALSE, i * sizeof(int), sizeof(int), &changed[i], 0, NULL,
+                                         record_command(commands, &slot->numberOfCommands, "read_changed", i));
+            check_status(status, "clEnqueueReadBuffer(changed)");
+            status = clFlush(commandQueue);
+            check_status(status, "clFlush");
+        }
+
+        // Obdelamo končana preverjanja, na nedokončana počakamo le, če smo preveč pred njimi
+        while (firstPendingCheck < numberOfChecks && !converged)
+        {
+            cl_event checkEvent = commands[checkCommands[firstPendingCheck]].event;
+            cl_int executionStatus;
+            status = clGetEventInfo(checkEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &executionStatus, NULL);
+            check_status(status, "clGetEventInfo");
+            if (executionStatus != CL_COMPLETE)
+            {
+                if (i - checkIterations[firstPendingCheck] < lookahead)
+                    break;
+                status = clWaitForEvents(1, &checkEvent);
+                check_status(status, "clWaitForEvents");
+            }
+            converged = changed[checkIterations[firstPendingCheck]] <= slot->threshold;
+
+            if (settings->timeBudgetMs >= 0)
+            {
+                cl_ulong firstStart, checkEnd;
+                status = clGetEventProfilingInfo(commands[firstIterationCommand].event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &firstStart, NULL);
+                status |= clGetEventProfilingInfo(checkEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &checkEnd, NULL);
+                check_status(status, "clGetEventProfilingInfo");
+                completedIterations = checkIterations[firstPendingCheck] + 1;
+                iterationTime = (checkEnd - firstStart) / 1e9 / completedIterations;
+            }
+            firstPendingCheck++;
+        }
     }
 
-    status = clEnqueueNDRangeKernel(commandQueue, rebuildImage_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL, NULL);
+    if (settings->timeBudgetMs >= 0 && slot->numberOfEnqueued > 0)
+    {
+        // Počakamo na vse iteracije in izberemo centroide z najmanjšo inercijo
+        status = clEnqueueReadBuffer(commandQueue, slot->changed_d, CL_TRUE, 0, numberOfIterations * sizeof(int), changed, 0, NULL, NULL);
+        status |= clEnqueueReadBuffer(commandQueue, slot->inertia_d, CL_TRUE, 0, 2 * numberOfIterations * sizeof(cl_uint), slot->inertiaSums, 0, NULL, NULL);
+        check_status(status, "clEnqueueReadBuffer(inertia)");
+        int iterationsRun = iterations_run(slot);
+        int best = 0;
+        for (int i = 0; i < iterationsRun; i++)
+        {
+            long long inertia = slot->inertiaSums[2 * i] | (long long)slot->inertiaSums[2 * i + 1] << 32;
+            if (i == 0 || inertia < slot->inertia)
+            {
+                slot->inertia = inertia;
+                best = i;
+            }
+        }
+        status = clEnqueueCopyBuffer(commandQueue, slot->history_d, slot->centroids_d, (size_t)best * numberOfClusters * sizeof(struct Point), 0,
+                                     numberOfClusters * sizeof(struct Point), 0, NULL, record_command(commands, &slot->numberOfCommands, "copy_best_centroids", -1));
+        check_status(status, "clEnqueueCopyBuffer(history)");
 
-    // Čakanje na konec izvajanja vseh ščepcev
-    // clWaitForEvents(numberOfIterations + 2, events);
+        // Dodelitve pripadajo zadnji iteraciji, za starejše centroide razvrstimo še enkrat (prag -1 prepreči preskok)
+        if (best < iterationsRun - 1)
+        {
+            const cl_int never = -1;
+            status = clSetKernelArg(slot->arrangeInClusters_kernel, 9, sizeof(cl_int), (void *)&numberOfIterations);
+            status |= clSetKernelArg(slot->arrangeInClusters_kernel, 10, sizeof(cl_int), (void *)&never);
+            check_status(status, "clSetKernelArg(arrange_in_clusters)");
+            status = clEnqueueNDRangeKernel(commandQueue, slot->arrangeInClusters_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL,
+                                            record_command(commands, &slot->numberOfCommands, "arrange_in_clusters", -1));
+            check_status(status, "clEnqueueNDRangeKernel(arrange_in_clusters)");
+        }
+    }
 
-    // Kopiranje rezultatov
-    status = clEnqueueReadBuffer(commandQueue, image_d, CL_TRUE, 0, imageSize, image, 0, NULL, NULL);
+    // Kopiranje rezultatov: celotna slika ali le indeksi gruč in tabela centroidov
+    slot->indices = NULL;
+    if (settings->indexReadback)
+    {
+        status = clEnqueueNDRangeKernel(commandQueue, slot->packIndices_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL,
+                                        record_command(commands, &slot->numberOfCommands, "pack_indices", -1));
+        check_status(status, "clEnqueueNDRangeKernel(pack_indices)");
+        status = clEnqueueReadBuffer(commandQueue, slot->centroids_d, CL_FALSE, 0, numberOfClusters * sizeof(struct Point), slot->centroids, 0, NULL,
+                                     record_command(commands, &slot->numberOfCommands, "read_centroids", -1));
+        check_status(status, "clEnqueueReadBuffer(centroids)");
+        slot->indices = clEnqueueMapBuffer(commandQueue, slot->indices_d, CL_FALSE, CL_MAP_READ, 0, numberOfPixels * indexSize, 0, NULL,
+                                           record_command(commands, &slot->numberOfCommands, "map_indices", -1), &status);
+        check_status(status, "clEnqueueMapBuffer(indices)");
+    }
+    else
+    {
+        status = clEnqueueNDRangeKernel(commandQueue, slot->rebuildImage_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL,
+                                        record_command(commands, &slot->numberOfCommands, "rebuild_image", -1));
+        check_status(status, "clEnqueueNDRangeKernel(rebuild_image)");
+        status = clEnqueueReadBuffer(commandQueue, slot->image_d, CL_FALSE, 0, imageSize, slot->image, 0, NULL,
+                                     record_command(commands, &slot->numberOfCommands, "read_image", -1));
+        check_status(status, "clEnqueueReadBuffer(image)");
+    }
     // branje v pomnilnik iz naprave, 0 = offset
-    // zadnji trije dogodki, ki se morajo zgoditi prej
+
+    // Število premaknjenih vzorcev in inercija v vseh iteracijah
+    status = clEnqueueReadBuffer(commandQueue, slot->changed_d, CL_FALSE, 0, numberOfIterations * sizeof(int), changed, 0, NULL,
+                                 record_command(commands, &slot->numberOfCommands, "read_changed", -1));
+    status |= clEnqueueReadBuffer(commandQueue, slot->inertia_d, CL_FALSE, 0, 2 * numberOfIterations * sizeof(cl_uint), slot->inertiaSums, 0, NULL,
+                                  record_command(commands, &slot->numberOfCommands, "read_inertia", -1));
+    check_status(status, "clEnqueueReadBuffer(changed)");
+
+    status = clFlush(commandQueue);
+    check_status(status, "clFlush");
+    slot->busy = 1;
+}
+
+
+/**
+ *   @brief Sets the kernel arguments that stay the same for every iteration of an image
+ *
+ *   @param slot prepared slot with a loaded image
+ *   @param settings settings of the run
+ */
+void set_kernel_args(struct Slot *slot, struct Settings *settings)
+{
+    int numberOfClusters = settings->numberOfClusters;
+    int width = slot->width;
+    int height = slot->height;
+
+    // Ščepec: argumenti
+    status = clSetKernelArg(slot->initializeValues_kernel, 0, sizeof(cl_mem), (void *)&slot->image_d);
+    status |= clSetKernelArg(slot->initializeValues_kernel, 1, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(slot->initializeValues_kernel, 2, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(slot->initializeValues_kernel, 3, sizeof(cl_mem), (void *)&slot->centroids_d);
+    status |= clSetKernelArg(slot->initializeValues_kernel, 4, sizeof(cl_int), (void *)&numberOfClusters);
+    status |= clSetKernelArg(slot->initializeValues_kernel, 5, sizeof(ulong), (void *)&settings->randomSeed);
+
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 0, sizeof(cl_mem), (void *)&slot->image_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 1, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 2, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 3, sizeof(cl_mem), (void *)&slot->centroids_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 4, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 5, sizeof(cl_mem), (void *)&slot->sum_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 6, sizeof(cl_mem), (void *)&slot->n_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 7, sizeof(cl_mem), (void *)&slot->changed_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 8, sizeof(cl_mem), (void *)&slot->inertia_d);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 10, sizeof(cl_int), (void *)&slot->threshold);
+    status |= clSetKernelArg(slot->arrangeInClusters_kernel, 11, sizeof(cl_int), (void *)&numberOfClusters);
+    if (!settings->specialize)
+    {
+        // Specializirani ščepci imajo lokalni pomnilnik statično določen
+        status |= clSetKernelArg(slot->arrangeInClusters_kernel, 12, numberOfClusters * sizeof(struct Point), NULL);
+        status |= clSetKernelArg(slot->arrangeInClusters_kernel, 13, numberOfClusters * sizeof(int), NULL);
+    }
+
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 0, sizeof(cl_mem), (void *)&slot->image_d);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 1, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 2, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 3, sizeof(cl_mem), (void *)&slot->centroids_d);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 4, sizeof(cl_mem), (void *)&slot->sum_d);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 5, sizeof(cl_mem), (void *)&slot->n_d);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 6, sizeof(cl_int), (void *)&numberOfClusters);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 7, sizeof(ulong), (void *)&settings->randomSeed);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 8, sizeof(cl_mem), (void *)&slot->changed_d);
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 10, sizeof(cl_int), (void *)&slot->threshold);
+    // Brez časovne omejitve je history_d NULL in ščepec centroidov ne shranjuje
+    status |= clSetKernelArg(slot->updateCentroidValues_kernel, 11, sizeof(cl_mem), (void *)&slot->history_d);
+
+    status |= clSetKernelArg(slot->rebuildImage_kernel, 0, sizeof(cl_mem), (void *)&slot->image_d);
+    status |= clSetKernelArg(slot->rebuildImage_kernel, 1, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(slot->rebuildImage_kernel, 2, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(slot->rebuildImage_kernel, 3, sizeof(cl_mem), (void *)&slot->centroids_d);
+    status |= clSetKernelArg(slot->rebuildImage_kernel, 4, sizeof(cl_mem), (void *)&slot->c_d);
+
+    int numberOfPixels = width * height;
+    status |= clSetKernelArg(slot->packIndices_kernel, 0, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(slot->packIndices_kernel, 1, sizeof(cl_mem), (void *)&slot->indices_d);
+    status |= clSetKernelArg(slot->packIndices_kernel, 2, sizeof(cl_int), (void *)&numberOfPixels);
+    check_status(status, "clSetKernelArg");
+    // ščepec, številka argumenta, velikost podatkov, kazalec na podatke
+}
+
+
+/**
+ *   @brief Assigns a range of pixels to the nearest centroids on the host and accumulates cluster sums
+ *
+ *   @param image raw image data (BGRA)
+ *   @param first first pixel of the range
+ *   @param last one past the last pixel of the range
+ *   @param centroids centroid table
+ *   @param numberOfClusters number of centroids
+ *   @param c cluster index of every pixel, updated in place
+ *   @param sum per cluster RGBA sums, accumulated
+ *   @param n per cluster sample counts, accumulated
+ *   @param inertia sum of squared distances to the nearest centroids, accumulated
+ *
+ *   @return number of pixels that changed cluster
+ */
+int host_arrange_in_clusters(unsigned char *image, int first, int last, struct Point *centroids, int numberOfClusters, int *c, struct Point *sum, int *n, long long *inertia)
+{
+    int changed = 0;
+    long long distances = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        struct Point *localSum = calloc(numberOfClusters, sizeof(struct Point));
+        int *localN = calloc(numberOfClusters, sizeof(int));
+
+#ifdef _OPENMP
+#pragma omp for reduction(+ : changed, distances)
+#endif
+        for (int i = first; i < last; i++)
+        {
+            unsigned char *pixel = &image[(size_t)i * 4];
+            int deviation;
+            int nearest = nearest_centroid(pixel, centroids, numberOfClusters, &deviation);
+            distances += deviation;
+            if (c[i] != nearest)
+                changed++;
+            c[i] = nearest;
+
+            localSum[nearest].r += pixel[2];
+            localSum[nearest].g += pixel[1];
+            localSum[nearest].b += pixel[0];
+            localSum[nearest].a += pixel[3];
+            localN[nearest]++;
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (int k = 0; k < numberOfClusters; k++)
+        {
+            sum[k].r += localSum[k].r;
+            sum[k].g += localSum[k].g;
+            sum[k].b += localSum[k].b;
+            sum[k].a += localSum[k].a;
+            n[k] += localN[k];
+        }
+
+        free(localSum);
+        free(localN);
+    }
+
+    *inertia += distances;
+    return changed;
+}
+
+
+/**
+ *   @brief Returns the index of the centroid nearest to a pixel, same metric as the kernels
+ *
+ *   @param pixel pointer to a BGRA pixel
+ *   @param centroids centroid table
+ *   @param numberOfClusters number of centroids
+ *   @param deviation squared distance to the nearest centroid, set on return
+ *
+ *   @return index of the nearest centroid (lowest index on ties)
+ */
+int nearest_centroid(const unsigned char *pixel, struct Point *centroids, int numberOfClusters, int *deviation)
+{
+    int minDeviation = -1;
+    int nearest = 0;
+
+    for (int k = 0; k < numberOfClusters; k++)
+    {
+        int dr = pixel[2] - centroids[k].r;
+        int dg = pixel[1] - centroids[k].g;
+        int db = pixel[0] - centroids[k].b;
+        int da = pixel[3] - centroids[k].a;
+        int deviation = dr * dr + dg * dg + db * db + da * da;
+        if (minDeviation < 0 || deviation < minDeviation)
+        {
+            minDeviation = deviation;
+            nearest = k;
+        }
+    }
+
+    *deviation = minDeviation;
+    return nearest;
+}
+
+
+/**
+ *   @brief Clusters the image in a slot on the device and the host cores at the same time
+ *
+ *   Every iteration the device assigns the first deviceRows rows with arrange_in_clusters while an OpenMP
+ *   loop assigns the rest. Both partial sums are merged and the centroids are updated on the host. The
+ *   split follows the throughput of both sides measured in the previous iteration (device time from queue
+ *   profiling). The host array of cluster indices is authoritative: rows that move to the device are
+ *   uploaded to c_d and rows that move back are read from it, so changed counts only real reassignments.
+ *   The output image is rebuilt on the host from the final centroids, and the inertia reported for it is
+ *   summed in the same pass. With a time budget an iteration only starts if one more iteration of the last
+ *   measured length still leaves time to rebuild and save the image, and the final centroids are those of
+ *   the iteration with the lowest inertia.
+ *
+ *   @param slot slot prepared with a 4-channel program, its queue must have profiling enabled
+ *   @param settings settings of the run
+ */
+void coexecute_image(struct Slot *slot, struct Settings *settings)
+{
+    cl_command_queue commandQueue = slot->queue;
+    int numberOfClusters = settings->numberOfClusters;
+    int numberOfIterations = settings->numberOfIterations;
+    int width = slot->width;
+    int height = slot->height;
+    int numberOfPixels = width * height;
+    size_t imageSize = height * slot->pitch * sizeof(char);
+
+    const size_t localItemSize1 = slot->maxWorkGroupSize < 256 ? slot->maxWorkGroupSize : 256;
+    const size_t localItemSize2 = 16;
+    const size_t globalItemSize2 = ((numberOfClusters - 1) / localItemSize2 + 1) * localItemSize2;
+
+    // Gostitelj sam odloča o konvergenci, zato naprava nikoli ne preskoči iteracije
+    set_kernel_args(slot, settings);
+    slot->threshold = settings->tolerance * width * height;
+    const cl_int never = -1;
+    status = clSetKernelArg(slot->arrangeInClusters_kernel, 10, sizeof(cl_int), (void *)&never);
+    check_status(status, "clSetKernelArg(threshold)");
+
+    struct Command *commands = slot->commands;
+    slot->numberOfCommands = 0;
+
+    const cl_int zero = 0, none = -1;
+    status = clEnqueueFillBuffer(commandQueue, slot->sum_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(struct Point), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->n_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(int), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->changed_d, &zero, sizeof(cl_int), 0, (numberOfIterations + 1) * sizeof(int), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->inertia_d, &zero, sizeof(cl_int), 0, 2 * (numberOfIterations + 1) * sizeof(cl_uint), 0, NULL, NULL);
+    status |= clEnqueueFillBuffer(commandQueue, slot->c_d, &none, sizeof(cl_int), 0, numberOfPixels * sizeof(int), 0, NULL, NULL);
+    check_status(status, "clEnqueueFillBuffer");
+    status = clEnqueueWriteBuffer(commandQueue, slot->image_d, CL_FALSE, 0, imageSize, slot->image, 0, NULL,
+                                  record_command(commands, &slot->numberOfCommands, "write_image", -1));
+    check_status(status, "clEnqueueWriteBuffer(image)");
+
+    // Začetni centroidi so izbrani na napravi kot v običajnem načinu
+    status = clEnqueueNDRangeKernel(commandQueue, slot->initializeValues_kernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL,
+                                    record_command(commands, &slot->numberOfCommands, "initialize_values", -1));
+    check_status(status, "clEnqueueNDRangeKernel(initialize_values)");
+    status = clEnqueueReadBuffer(commandQueue, slot->centroids_d, CL_TRUE, 0, numberOfClusters * sizeof(struct Point), slot->centroids, 0, NULL,
+                                 record_command(commands, &slot->numberOfCommands, "read_centroids", -1));
+    check_status(status, "clEnqueueReadBuffer(centroids)");
+
+    struct Point *sum = malloc(numberOfClusters * sizeof(struct Point));
+    struct Point *deviceSum = malloc(numberOfClusters * sizeof(struct Point));
+    int *n = malloc(numberOfClusters * sizeof(int));
+    int *deviceN = malloc(numberOfClusters * sizeof(int));
+    int *c = malloc(numberOfPixels * sizeof(int));
+    for (int i = 0; i < numberOfPixels; i++)
+        c[i] = -1;
+
+    // Vsaka stran dobi vsaj nekaj vrstic, da lahko izmerimo njeno prepustnost
+    int minimumRows = height / 64 > 0 ? height / 64 : 1;
+    double deviceShare = settings->deviceShare;
+    int previousDeviceRows = 0;
+    int *changed = slot->changed;
+    memset(changed, 0, (numberOfIterations + 1) * sizeof(int));
+
+    // Časovna omejitev: najboljši izmerjeni centroidi in trajanje zadnje iteracije
+    struct Point *bestCentroids = malloc(numberOfClusters * sizeof(struct Point));
+    double iterationTime = 0;
+    double reserve = (double)numberOfPixels * TIME_BUDGET_RESERVE_NS / 1e9;
+    slot->numberOfEnqueued = 0;
+    slot->budgetExhausted = 0;
+    slot->inertia = -1;
+
+    for (int i = 0; i < numberOfIterations; i++)
+    {
+        if (settings->timeBudgetMs >= 0 && i > 0 && seconds_since(programStart) + iterationTime + reserve > settings->timeBudgetMs / 1000.0)
+        {
+            slot->budgetExhausted = 1;
+            break;
+        }
+        struct timespec iterationStart;
+        clock_gettime(CLOCK_MONOTONIC, &iterationStart);
+
+        int deviceRows = deviceShare * height + 0.5;
+        if (deviceRows < minimumRows)
+            deviceRows = height > minimumRows ? minimumRows : 0;
+        if (deviceRows > height - minimumRows)
+            deviceRows = height - minimumRows;
+        int devicePixels = deviceRows * width;
+        int firstCommand = slot->numberOfCommands;
+
+        // Vrstice, ki zamenjajo stran, prenesejo svoje dodelitve iz prejšnje iteracije
+        if (deviceRows > previousDeviceRows)
+        {
+            status = clEnqueueWriteBuffer(commandQueue, slot->c_d, CL_FALSE, (size_t)previousDeviceRows * width * sizeof(int),
+                                          (size_t)(deviceRows - previousDeviceRows) * width * sizeof(int), &c[previousDeviceRows * width], 0, NULL,
+                                          record_command(commands, &slot->numberOfCommands, "write_c", i));
+            check_status(status, "clEnqueueWriteBuffer(c)");
+        }
+        else if (deviceRows < previousDeviceRows)
+        {
+            status = clEnqueueReadBuffer(commandQueue, slot->c_d, CL_TRUE, (size_t)deviceRows * width * sizeof(int),
+                                         (size_t)(previousDeviceRows - deviceRows) * width * sizeof(int), &c[devicePixels], 0, NULL,
+                                         record_command(commands, &slot->numberOfCommands, "read_c", i));
+            check_status(status, "clEnqueueReadBuffer(c)");
+        }
+        previousDeviceRows = deviceRows;
+
+        // Naprava: nova tabela centroidov, razvrščanje prvih deviceRows vrstic in branje delnih vsot
+        status = clEnqueueWriteBuffer(commandQueue, slot->centroids_d, CL_FALSE, 0, numberOfClusters * sizeof(struct Point), slot->centroids, 0, NULL,
+                                      record_command(commands, &slot->numberOfCommands, "write_centroids", i));
+        check_status(status, "clEnqueueWriteBuffer(centroids)");
+        if (devicePixels > 0)
+        {
+            const size_t globalItemSize1 = ((devicePixels - 1) / localItemSize1 + 1) * localItemSize1;
+            status = clSetKernelArg(slot->arrangeInClusters_kernel, 2, sizeof(cl_int), (void *)&deviceRows);
+            status |= clSetKernelArg(slot->arrangeInClusters_kernel, 9, sizeof(cl_int), (void *)&i);
+            check_status(status, "clSetKernelArg(arrange_in_clusters)");
+            status = clEnqueueNDRangeKernel(commandQueue, slot->arrangeInClusters_kernel, 1, NULL, &globalItemSize1, &localItemSize1, 0, NULL,
+                                            record_command(commands, &slot->numberOfCommands, "arrange_in_clusters", i));
+            check_status(status, "clEnqueueNDRangeKernel(arrange_in_clusters)");
+        }
+        status = clEnqueueReadBuffer(commandQueue, slot->sum_d, CL_FALSE, 0, numberOfClusters * sizeof(struct Point), deviceSum, 0, NULL,
+                                     record_command(commands, &slot->numberOfCommands, "read_sum", i));
+        status |= clEnqueueReadBuffer(commandQueue, slot->n_d, CL_FALSE, 0, numberOfClusters * sizeof(int), deviceN, 0, NULL,
+                                      record_command(commands, &slot->numberOfCommands, "read_n", i));
+        status |= clEnqueueReadBuffer(commandQueue, slot->changed_d, CL_FALSE, i * sizeof(int), sizeof(int), &changed[i], 0, NULL,
+                                      record_command(commands, &slot->numberOfCommands, "read_changed", i));
+        status |= clEnqueueReadBuffer(commandQueue, slot->inertia_d, CL_FALSE, 2 * i * sizeof(cl_uint), 2 * sizeof(cl_uint), &slot->inertiaSums[2 * i], 0, NULL,
+                                      record_command(commands, &slot->numberOfCommands, "read_inertia", i));
+        check_status(status, "clEnqueueReadBuffer(partial sums)");
+        status = clEnqueueFillBuffer(commandQueue, slot->sum_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(struct Point), 0, NULL, NULL);
+        status |= clEnqueueFillBuffer(commandQueue, slot->n_d, &zero, sizeof(cl_int), 0, numberOfClusters * sizeof(int), 0, NULL, NULL);
+        check_status(status, "clEnqueueFillBuffer");
+        status = clFlush(commandQueue);
+        check_status(status, "clFlush");
+
+        // Gostitelj: preostale vrstice
+        struct timespec hostStart, hostFinish;
+        clock_gettime(CLOCK_MONOTONIC, &hostStart);
+        memset(sum, 0, numberOfClusters * sizeof(struct Point));
+        memset(n, 0, numberOfClusters * sizeof(int));
+        long long inertia = 0;
+        int hostChanged = host_arrange_in_clusters(slot->image, devicePixels, numberOfPixels, slot->centroids, numberOfClusters, c, sum, n, &inertia);
+        clock_gettime(CLOCK_MONOTONIC, &hostFinish);
+        double hostTime = (hostFinish.tv_sec - hostStart.tv_sec) + (hostFinish.tv_nsec - hostStart.tv_nsec) / 1000000000.0;
+
+        status = clWaitForEvents(1, &commands[slot->numberOfCommands - 1].event);
+        check_status(status, "clWaitForEvents");
+
+        // Inercija velja za centroide pred posodobitvijo; s časovno omejitvijo izbere najboljše centroide
+        changed[i] += hostChanged;
+        inertia += slot->inertiaSums[2 * i] | (long long)slot->inertiaSums[2 * i + 1] << 32;
+        if (slot->inertia < 0 || inertia < slot->inertia || settings->timeBudgetMs < 0)
+        {
+            memcpy(bestCentroids, slot->centroids, numberOfClusters * sizeof(struct Point));
+            slot->inertia = inertia;
+        }
+        slot->numberOfEnqueued++;
+
+        // Združevanje delnih vsot in posodobitev centroidov (prazna gruča dobi naključen vzorec)
+        for (int k = 0; k < numberOfClusters; k++)
+        {
+            sum[k].r += deviceSum[k].r;
+            sum[k].g += deviceSum[k].g;
+            sum[k].b += deviceSum[k].b;
+            sum[k].a += deviceSum[k].a;
+            n[k] += deviceN[k];
+            if (n[k] == 0)
+            {
+                unsigned char *pixel = &slot->image[(size_t)(random() % numberOfPixels) * 4];
+                struct Point point = {pixel[2], pixel[1], pixel[0], pixel[3]};
+                sum[k] = point;
+                n[k] = 1;
+            }
+            slot->centroids[k].r = sum[k].r / n[k];
+            slot->centroids[k].g = sum[k].g / n[k];
+            slot->centroids[k].b = sum[k].b / n[k];
+            slot->centroids[k].a = sum[k].a / n[k];
+        }
+
+        // Nova delitev glede na izmerjeno prepustnost obeh strani
+        cl_ulong deviceStart, deviceEnd;
+        status = clGetEventProfilingInfo(commands[firstCommand].event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &deviceStart, NULL);
+        status |= clGetEventProfilingInfo(commands[slot->numberOfCommands - 1].event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &deviceEnd, NULL);
+        check_status(status, "clGetEventProfilingInfo");
+        double deviceTime = (deviceEnd - deviceStart) / 1e9;
+        if (devicePixels > 0 && devicePixels < numberOfPixels && deviceTime > 0 && hostTime > 0)
+        {
+            double deviceRate = devicePixels / deviceTime;
+            double hostRate = (numberOfPixels - devicePixels) / hostTime;
+            deviceShare = 0.5 * deviceShare + 0.5 * deviceRate / (deviceRate + hostRate);
+        }
+
+        iterationTime = seconds_since(iterationStart);
+        if (changed[i] <= slot->threshold)
+            break;
+    }
+    if (settings->timeBudgetMs >= 0 && slot->inertia >= 0)
+        memcpy(slot->centroids, bestCentroids, numberOfClusters * sizeof(struct Point));
+    free(bestCentroids);
+
+    // Rekonstrukcija slike na gostitelju s končnimi centroidi; izpisana inercija je inercija zapisane slike
+    long long finalInertia = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+ : finalInertia)
+#endif
+    for (int i = 0; i < numberOfPixels; i++)
+    {
+        unsigned char *pixel = &slot->image[(size_t)i * 4];
+        int deviation;
+        struct Point point = slot->centroids[nearest_centroid(pixel, slot->centroids, numberOfClusters, &deviation)];
+        finalInertia += deviation;
+        pixel[2] = point.r;
+        pixel[1] = point.g;
+        pixel[0] = point.b;
+        pixel[3] = point.a;
+    }
+    slot->inertia = finalInertia;
+
+    printf("Delež naprave: %.1f %%\n", 100.0 * deviceShare);
+
+    free(sum);
+    free(deviceSum);
+    free(n);
+    free(deviceN);
+    free(c);
+    slot->indices = NULL;
+    slot->busy = 1;
+}
+
+
+/**
+ *   @brief Waits for the image in a slot, reports it and writes the output image
+ *
+ *   @param slot slot with an enqueued image
+ *   @param settings settings of the run
+ *   @param profileName file for the profile JSON or NULL
+ *
+ *   @return 1 if the output image was saved, 0 otherwise
+ */
+int finish_image(struct Slot *slot, struct Settings *settings, const char *profileName)
+{
+    int numberOfIterations = settings->numberOfIterations;
+    int indexSize = settings->numberOfClusters <= 256 ? 1 : 2;
+
+    // Čakanje na konec izvajanja vseh ukazov
+    status = clWaitForEvents(1, &slot->commands[slot->numberOfCommands - 1].event);
+    check_status(status, "clWaitForEvents");
+
+    // Inercija izhodne palete; brez časovne omejitve je to inercija zadnje izvedene iteracije
+    int iterationsRun = iterations_run(slot);
+    long long inertia = slot->inertia;
+    if (inertia < 0 && iterationsRun > 0)
+        inertia = slot->inertiaSums[2 * (iterationsRun - 1)] | (long long)slot->inertiaSums[2 * (iterationsRun - 1) + 1] << 32;
 
     // Izračun časa izvajanja
+    struct timespec finish;
     clock_gettime(CLOCK_MONOTONIC, &finish);
-    double elapsed = (finish.tv_sec - start.tv_sec);
-    elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    double elapsed = (finish.tv_sec - slot->start.tv_sec);
+    elapsed += (finish.tv_nsec - slot->start.tv_nsec) / 1000000000.0;
 
-    printf("Čas izvajanja programa: %f sekund\n", elapsed);
+    printf("%s: Čas izvajanja programa: %f sekund\n", slot->outName, elapsed);
+    printf("Iteracije: %d / %d%s\n", iterationsRun, numberOfIterations,
+           slot->budgetExhausted && iterationsRun == slot->numberOfEnqueued ? " (časovna omejitev)" : iterationsRun < numberOfIterations ? " (konvergenca)" : "");
+    printf("Inercija: %lld\n", inertia);
+    printf("PSNR: %.2f dB\n", 10.0 * log10(255.0 * 255.0 * 3.0 * slot->width * slot->height / (inertia > 0 ? inertia : 1)));
+
+    if (profileName)
+        write_profile_json(profileName, slot->commands, slot->numberOfCommands, numberOfIterations, elapsed);
+
+    for (int i = 0; i < slot->numberOfCommands; i++)
+        clReleaseEvent(slot->commands[i].event);
+    slot->numberOfCommands = 0;
 
     // Write output image to file
-    FIBITMAP *imageOutBitmap32 = FreeImage_ConvertFromRawBits(image, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-    FreeImage_Save(FIF_PNG, imageOutBitmap32, imageOutName, 0);
+    struct timespec encodeStart, encodeFinish;
+    clock_gettime(CLOCK_MONOTONIC, &encodeStart);
+    int saved;
+    if (settings->palettePng || kmc_is_kmc(slot->outName))
+    {
+        unsigned char *palette = malloc(settings->numberOfClusters * 4);
+        for (int k = 0; k < settings->numberOfClusters; k++)
+        {
+            palette[k * 4 + 0] = slot->centroids[k].b;
+            palette[k * 4 + 1] = slot->centroids[k].g;
+            palette[k * 4 + 2] = slot->centroids[k].r;
+            palette[k * 4 + 3] = slot->centroids[k].a;
+        }
+        if (kmc_is_kmc(slot->outName))
+            saved = kmc_write(slot->outName, slot->indices, indexSize, palette, settings->numberOfClusters, slot->width, slot->height);
+        else if (settings->pngLevel >= 0)
+            saved = save_png_parallel(slot->outName, slot->indices, slot->width, slot->height, slot->width, palette, settings->numberOfClusters, settings->pngLevel);
+        else
+            saved = save_palette_png(slot->outName, slot->indices, palette, settings->numberOfClusters, slot->width, slot->height);
+        free(palette);
+    }
+    else
+    {
+        if (settings->indexReadback)
+            expand_indices(slot->image, slot->indices, indexSize, slot->centroids, slot->width * slot->height);
+        if (settings->pngLevel >= 0)
+            saved = save_png_parallel(slot->outName, slot->image, slot->width, slot->height, slot->pitch, NULL, 0, settings->pngLevel);
+        else
+            saved = save_rgba_png(slot->outName, slot->image, slot->width, slot->height, slot->pitch);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &encodeFinish);
+    if (saved)
+        print_output_stats(slot->outName, (encodeFinish.tv_sec - encodeStart.tv_sec) + (encodeFinish.tv_nsec - encodeStart.tv_nsec) / 1000000000.0,
+                           (long long)slot->width * slot->height);
+    if (!saved)
+        fprintf(stderr, "Could not save image '%s'.\n", slot->outName);
+    if (settings->timeBudgetMs >= 0)
+        printf("Skupni čas: %.0f ms (omejitev %d ms)\n", seconds_since(programStart) * 1000.0, settings->timeBudgetMs);
 
-    // Cleanup
-    status = clFlush(commandQueue);
-    status |= clFinish(commandQueue);
-    status |= clReleaseKernel(initializeValues_kernel);
-    status |= clReleaseKernel(arrangeInClusters_kernel);
-    status |= clReleaseKernel(updateCentroidValues_kernel);
-    status |= clReleaseKernel(rebuildImage_kernel);
-    status |= clReleaseProgram(program);
-    status |= clReleaseMemObject(image_d);
-    status |= clReleaseMemObject(centroids_d);
-    status |= clReleaseMemObject(c_d);
-    status |= clReleaseMemObject(sum_d);
-    status |= clReleaseMemObject(n_d);
-    status |= clReleaseCommandQueue(commandQueue);
-    status |= clReleaseContext(context);
+    if (slot->indices)
+    {
+        status = clEnqueueUnmapMemObject(slot->queue, slot->indices_d, slot->indices, 0, NULL, NULL);
+        check_status(status, "clEnqueueUnmapMemObject(indices)");
+        slot->indices = NULL;
+    }
+
+    slot->busy = 0;
+    return saved;
+}
 
-    // Free source image data
-    FreeImage_Unload(imageBitmap32);
-    FreeImage_Unload(imageOutBitmap32);
-    FreeImage_Unload(imageBitmap);
 
-    free(image);
+/**
+ *   @brief Returns the number of iterations that ran: up to the first in which at most threshold samples moved
+ *
+ *   @param slot slot whose changed counters have been read back
+ *
+ *   @return number of iterations that ran on the device
+ */
+int iterations_run(struct Slot *slot)
+{
+    for (int i = 0; i < slot->numberOfEnqueued; i++)
+    {
+        if (slot->changed[i] <= slot->threshold)
+            return i + 1;
+    }
+    return slot->numberOfEnqueued;
+}
+
+
+/**
+ *   @brief Returns the time elapsed since a point in time
+ *
+ *   @param start CLOCK_MONOTONIC time
+ *
+ *   @return elapsed time in seconds
+ */
+double seconds_since(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+
+/**
+ *   @brief Releases the queue, kernels, buffers and host memory of a slot
+ *
+ *   @param slot slot to release
+ */
+void release_slot(struct Slot *slot)
+{
+    status = clFlush(slot->queue);
+    status |= clFinish(slot->queue);
+    if (slot->program)
+    {
+        status |= clReleaseKernel(slot->initializeValues_kernel);
+        status |= clReleaseKernel(slot->arrangeInClusters_kernel);
+        status |= clReleaseKernel(slot->updateCentroidValues_kernel);
+        status |= clReleaseKernel(slot->rebuildImage_kernel);
+        status |= clReleaseKernel(slot->packIndices_kernel);
+    }
+    if (slot->centroids_d)
+    {
+        status |= clReleaseMemObject(slot->centroids_d);
+        status |= clReleaseMemObject(slot->sum_d);
+        status |= clReleaseMemObject(slot->n_d);
+        status |= clReleaseMemObject(slot->changed_d);
+        status |= clReleaseMemObject(slot->inertia_d);
+        if (slot->history_d)
+            status |= clReleaseMemObject(slot->history_d);
+    }
+    if (slot->image_d)
+    {
+        status |= clReleaseMemObject(slot->image_d);
+        status |= clReleaseMemObject(slot->c_d);
+    }
+    if (slot->indices_d)
+        status |= clReleaseMemObject(slot->indices_d);
+    status |= clReleaseCommandQueue(slot->queue);
+    check_status(status, "cleanup");
+
+    free(slot->image);
+    free(slot->centroids);
+    free(slot->changed);
+    free(slot->inertiaSums);
+    free(slot->checkIterations);
+    free(slot->checkCommands);
+    free(slot->commands);
+}
+
+
+/**
+ *   @brief Terminates the program with a readable message if an OpenCL call failed
+ *
+ *   @param status value returned by the OpenCL call
+ *   @param operation name of the failed operation
+ */
+void check_status(cl_int status, const char *operation)
+{
+    if (status == CL_SUCCESS)
+        return;
+
+    fprintf(stderr, "OpenCL error %d in %s", status, operation);
+    if (status == CL_DEVICE_NOT_FOUND)
+        fprintf(stderr, " (device not found)");
+    else if (status == CL_BUILD_PROGRAM_FAILURE)
+        fprintf(stderr, " (kernel build failed)");
+    else if (status == -1001)
+        fprintf(stderr, " (no OpenCL platform installed)");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/**
+ *   @brief Returns the short name of an OpenCL device type
+ *
+ *   @param type device type bitfield
+ *
+ *   @return "gpu", "cpu", "accelerator" or "other"
+ */
+const char *device_type_name(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "gpu";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "cpu";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "accelerator";
+    return "other";
+}
+
+
+/**
+ *   @brief Prints every OpenCL device of every platform as platform:index
+ */
+void list_devices(void)
+{
+    cl_platform_id platforms[10];
+    cl_uint numberOfPlatforms = 0;
+    if (clGetPlatformIDs(10, platforms, &numberOfPlatforms) != CL_SUCCESS)
+        numberOfPlatforms = 0;
+
+    for (cl_uint p = 0; p < numberOfPlatforms; p++)
+    {
+        char platformName[256];
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(platformName), platformName, NULL);
+
+        cl_device_id devices[10];
+        cl_uint numberOfDevices = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 10, devices, &numberOfDevices) != CL_SUCCESS)
+            numberOfDevices = 0;
+
+        for (cl_uint d = 0; d < numberOfDevices; d++)
+        {
+            char deviceName[256];
+            cl_device_type type;
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+            clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+            printf("  %u:%u  %-11s %s (%s)\n", p, d, device_type_name(type), deviceName, platformName);
+        }
+    }
+
+    if (numberOfPlatforms == 0)
+        printf("  no OpenCL platforms found\n");
+}
+
+
+/**
+ *   @brief Picks an OpenCL device from a "type[:platform[:index]]" specification
+ *
+ *   Type is one of gpu, cpu, accelerator or all. If only the type is given and no
+ *   such device exists, any CPU device (e.g. pocl) and then any device at all is used.
+ *
+ *   @param deviceSpec device specification from the command line
+ *   @param platform selected platform
+ *   @param device selected device
+ *
+ *   @return 1 if a device was found, 0 otherwise
+ */
+int select_device(const char *deviceSpec, cl_platform_id *platform, cl_device_id *device)
+{
+    char typeName[32] = "";
+    int platformIndex = -1;
+    int deviceIndex = -1;
+    sscanf(deviceSpec, "%31[^:]:%d:%d", typeName, &platformIndex, &deviceIndex);
+
+    cl_device_type requestedType;
+    if (strcmp(typeName, "gpu") == 0)
+        requestedType = CL_DEVICE_TYPE_GPU;
+    else if (strcmp(typeName, "cpu") == 0)
+        requestedType = CL_DEVICE_TYPE_CPU;
+    else if (strcmp(typeName, "accelerator") == 0)
+        requestedType = CL_DEVICE_TYPE_ACCELERATOR;
+    else if (strcmp(typeName, "all") == 0)
+        requestedType = CL_DEVICE_TYPE_ALL;
+    else
+    {
+        fprintf(stderr, "Unknown OpenCL device type '%s' (use gpu, cpu, accelerator or all).\n", typeName);
+        return 0;
+    }
+
+    cl_platform_id platforms[10];
+    cl_uint numberOfPlatforms = 0;
+    status = clGetPlatformIDs(10, platforms, &numberOfPlatforms);
+    if (status != CL_SUCCESS || numberOfPlatforms == 0)
+        return 0;
+
+    // Without an explicit platform/index we fall back GPU -> CPU -> anything
+    cl_device_type fallback[3] = {requestedType, CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_ALL};
+    int attempts = platformIndex < 0 ? 3 : 1;
+
+    for (int a = 0; a < attempts; a++)
+    {
+        for (cl_uint p = 0; p < numberOfPlatforms; p++)
+        {
+            if (platformIndex >= 0 && p != (cl_uint)platformIndex)
+                continue;
+
+            cl_device_id devices[10];
+            cl_uint numberOfDevices = 0;
+            if (clGetDeviceIDs(platforms[p], fallback[a], 10, devices, &numberOfDevices) != CL_SUCCESS)
+                continue;
+
+            int index = deviceIndex < 0 ? 0 : deviceIndex;
+            if (index < (int)numberOfDevices)
+            {
+                if (a > 0)
+                    fprintf(stderr, "No %s OpenCL device found, falling back to %s device.\n", typeName, a == 1 ? "a CPU" : "any");
+                *platform = platforms[p];
+                *device = devices[index];
+                return 1;
+            }
+        }
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+
+
+/**
+ *   @brief Prints name, type, compute units and local memory size of the chosen device
+ *
+ *   @param device selected device
+ */
+void print_device_info(cl_device_id device)
+{
+    char deviceName[256];
+    cl_device_type type;
+    cl_uint computeUnits;
+    cl_ulong localMemSize;
+
+    status = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemSize), &localMemSize, NULL);
+    check_status(status, "clGetDeviceInfo");
+
+    printf("Naprava: %s [%s], %u računskih enot, %llu KB lokalnega pomnilnika\n", deviceName, device_type_name(type),
+           computeUnits, (unsigned long long)localMemSize / 1024);
+}
+
+
+/**
+ *   @brief Returns 3 if every pixel is fully opaque (alpha can be left out of the distance), 4 otherwise
+ *
+ *   @param image BGRA sample array
+ *   @param numberOfPixels width * height
+ *
+ *   @return Number of channels that take part in clustering
+ */
+int image_channels(unsigned char *image, int numberOfPixels)
+{
+    for (int i = 0; i < numberOfPixels; i++)
+    {
+        if (image[i * 4 + 3] != 255)
+            return 4;
+    }
+    return 3;
+}
+
+
+/**
+ *   @brief Returns the kernel program built for given k and channel count
+ *
+ *   Specialized programs are compiled with -DK and -DCHANNELS, so the centroid loop is unrolled
+ *   and local arrays are statically sized. The last MAX_CACHED_PROGRAMS programs are cached per
+ *   (k, channels) in memory and, if cacheDir is set, as device binaries on disk.
+ *
+ *   @param context OpenCL context
+ *   @param device device to build for
+ *   @param source kernel source code
+ *   @param k number of clusters, 0 for the generic program
+ *   @param channels number of channels used in the distance (3 or 4)
+ *   @param cacheDir directory for cached binaries or NULL
+ *
+ *   @return Built program
+ */
+cl_program get_program(cl_context context, cl_device_id device, const char *source, int k, int channels, const char *cacheDir)
+{
+    for (int i = 0; i < numberOfCachedPrograms; i++)
+    {
+        if (programCache[i].k == k && programCache[i].channels == channels)
+            return programCache[i].program;
+    }
+
+    char options[256] = "";
+    if (k > 0)
+        sprintf(options, "-DK=%d -DCHANNELS=%d -cl-fast-relaxed-math -cl-mad-enable", k, channels);
+
+    // Binaries depend on the source, the options and the device
+    char deviceName[128];
+    status = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    check_status(status, "clGetDeviceInfo(CL_DEVICE_NAME)");
+    unsigned long hash = 5381;
+    for (const char *c = source; *c; c++)
+        hash = hash * 33 + (unsigned char)*c;
+    for (const char *c = deviceName; *c; c++)
+        hash = hash * 33 + (unsigned char)*c;
+
+    char cacheName[512] = "";
+    if (cacheDir)
+        sprintf(cacheName, "%s/kmeans_%016lx_k%d_c%d.bin", cacheDir, hash, k, channels);
+
+    cl_program program = NULL;
+    FILE *fp = cacheDir ? fopen(cacheName, "rb") : NULL;
+    if (fp)
+    {
+        fseek(fp, 0, SEEK_END);
+        size_t binarySize = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        unsigned char *binary = malloc(binarySize);
+        if (fread(binary, 1, binarySize, fp) == binarySize)
+        {
+            cl_int binaryStatus;
+            program = clCreateProgramWithBinary(context, 1, &device, &binarySize, (const unsigned char **)&binary, &binaryStatus, &status);
+            if (status != CL_SUCCESS || binaryStatus != CL_SUCCESS || clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS)
+            {
+                if (program)
+                    clReleaseProgram(program);
+                program = NULL;
+            }
+        }
+        free(binary);
+        fclose(fp);
+    }
+
+    if (!program)
+    {
+        program = clCreateProgramWithSource(context, 1, &source, NULL, &status);
+        check_status(status, "clCreateProgramWithSource");
+        // kontekst, število kazalcev na kodo, kazalci na kodo,
+        // stringi so NULL terminated, napaka
+
+        // Prevajanje
+        cl_int buildStatus = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        // program, število naprav, lista naprav, opcije pri prevajanju,
+        // kazalec na funkcijo, uporabniski argumenti
+
+        // Log
+        size_t build_log_len;
+        char *build_log;
+        status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len);
+        check_status(status, "clGetProgramBuildInfo");
+        // program, naprava, tip izpisa,
+        // maksimalna dolžina niza, kazalec na niz, dejanska dolžina niza
+        build_log = (char *)malloc(sizeof(char) * (build_log_len + 1));
+        status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, build_log_len, build_log, NULL);
+        check_status(status, "clGetProgramBuildInfo");
+        build_log[build_log_len] = '\0';
+        if (build_log_len > 1)
+            printf("%s\n", build_log);
+        free(build_log);
+        check_status(buildStatus, "clBuildProgram");
+
+        // Store the binary for the next run
+        fp = cacheDir ? fopen(cacheName, "wb") : NULL;
+        if (fp)
+        {
+            size_t binarySize;
+            status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+            unsigned char *binary = malloc(binarySize);
+            status |= clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL);
+            if (status == CL_SUCCESS)
+                fwrite(binary, 1, binarySize, fp);
+            free(binary);
+            fclose(fp);
+        }
+    }
+
+    // A full cache drops its oldest program; kernels a slot still holds keep it alive until they are released
+    if (numberOfCachedPrograms == MAX_CACHED_PROGRAMS)
+    {
+        status = clReleaseProgram(programCache[0].program);
+        check_status(status, "clReleaseProgram");
+        memmove(programCache, programCache + 1, (MAX_CACHED_PROGRAMS - 1) * sizeof(struct CachedProgram));
+        numberOfCachedPrograms--;
+    }
+    programCache[numberOfCachedPrograms].k = k;
+    programCache[numberOfCachedPrograms].channels = channels;
+    programCache[numberOfCachedPrograms].program = program;
+    numberOfCachedPrograms++;
+
+    return program;
+}
+
+
+/**
+ *   @brief Expands a cluster index map back to BGRA pixels
+ *
+ *   @param image output BGRA sample array
+ *   @param indices cluster index of every pixel (uchar or ushort)
+ *   @param indexSize size of one index in bytes (1 or 2)
+ *   @param centroids array of centroids
+ *   @param numberOfPixels width * height
+ */
+void expand_indices(unsigned char *image, const void *indices, int indexSize, struct Point *centroids, int numberOfPixels)
+{
+    for (int i = 0; i < numberOfPixels; i++)
+    {
+        int index = indexSize == 1 ? ((const unsigned char *)indices)[i] : ((const unsigned short *)indices)[i];
+        struct Point point = centroids[index];
+
+        image[i * 4 + 0] = point.b;
+        image[i * 4 + 1] = point.g;
+        image[i * 4 + 2] = point.r;
+        image[i * 4 + 3] = point.a;
+    }
+}
+
+
+/**
+ *   @brief Appends a command to the list and returns the slot for its event
+ *
+ *   @param commands array of enqueued commands
+ *   @param numberOfCommands number of commands in the array, incremented
+ *   @param name kernel or transfer name
+ *   @param iteration iteration of the main loop or -1
+ *
+ *   @return Pointer that should be passed as the event argument of clEnqueue*
+ */
+cl_event *record_command(struct Command *commands, int *numberOfCommands, const char *name, int iteration)
+{
+    struct Command *command = &commands[(*numberOfCommands)++];
+    command->name = name;
+    command->iteration = iteration;
+    command->event = NULL;
+    return &command->event;
+}
+
+
+/**
+ *   @brief Writes queued->start->end times of every command, per kernel and per iteration as JSON
+ *
+ *   Times are in milliseconds; "start_ms" is relative to the moment the first command was queued.
+ *
+ *   @param fileName output file, "-" for standard output
+ *   @param commands array of finished commands
+ *   @param numberOfCommands number of commands in the array
+ *   @param numberOfIterations number of iterations of the main loop
+ *   @param elapsed host wall time in seconds
+ */
+void write_profile_json(const char *fileName, struct Command *commands, int numberOfCommands, int numberOfIterations, double elapsed)
+{
+    // Totals per distinct command name, in order of first appearance
+    const char *kernelNames[16];
+    double kernelTotal[16] = {0};
+    double kernelQueued[16] = {0};
+    int kernelCount[16] = {0};
+    int numberOfKernelNames = 0;
+    double *iterationTotal = calloc(numberOfIterations > 0 ? numberOfIterations : 1, sizeof(double));
+
+    FILE *fp = strcmp(fileName, "-") == 0 ? stdout : fopen(fileName, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Could not open profile file '%s'.\n", fileName);
+        free(iterationTotal);
+        return;
+    }
+
+    cl_ulong origin = 0;
+    fprintf(fp, "{\n  \"backend\": \"opencl\",\n  \"elapsed_s\": %f,\n  \"phases\": [\n", elapsed);
+    for (int i = 0; i < numberOfCommands; i++)
+    {
+        cl_ulong queued, start, end;
+        status = clGetEventProfilingInfo(commands[i].event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+        status |= clGetEventProfilingInfo(commands[i].event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        status |= clGetEventProfilingInfo(commands[i].event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        check_status(status, "clGetEventProfilingInfo");
+        if (i == 0)
+            origin = queued;
+
+        double queuedToStart = (start - queued) / 1000000.0;
+        double startToEnd = (end - start) / 1000000.0;
+        fprintf(fp, "    {\"name\": \"%s\", \"iteration\": %d, \"start_ms\": %.6f, \"queued_to_start_ms\": %.6f, \"start_to_end_ms\": %.6f}%s\n",
+                commands[i].name, commands[i].iteration, (start - origin) / 1000000.0, queuedToStart, startToEnd,
+                i + 1 < numberOfCommands ? "," : "");
+
+        int k = 0;
+        while (k < numberOfKernelNames && strcmp(commands[i].name, kernelNames[k]) != 0)
+            k++;
+        if (k == numberOfKernelNames && numberOfKernelNames < 16)
+            kernelNames[numberOfKernelNames++] = commands[i].name;
+        if (k < numberOfKernelNames)
+        {
+            kernelTotal[k] += startToEnd;
+            kernelQueued[k] += queuedToStart;
+            kernelCount[k]++;
+        }
+        if (commands[i].iteration >= 0)
+            iterationTotal[commands[i].iteration] += startToEnd;
+    }
+
+    fprintf(fp, "  ],\n  \"kernels\": {\n");
+    for (int k = 0; k < numberOfKernelNames; k++)
+    {
+        fprintf(fp, "    \"%s\": {\"count\": %d, \"queued_to_start_ms\": %.6f, \"start_to_end_ms\": %.6f}%s\n",
+                kernelNames[k], kernelCount[k], kernelQueued[k], kernelTotal[k], k + 1 < numberOfKernelNames ? "," : "");
+    }
+
+    fprintf(fp, "  },\n  \"iterations_ms\": [");
+    for (int i = 0; i < numberOfIterations; i++)
+        fprintf(fp, "%s%.6f", i ? ", " : "", iterationTotal[i]);
+    fprintf(fp, "]\n}\n");
+
+    if (fp != stdout)
+        fclose(fp);
+    free(iterationTotal);
+}
@@ -0,0 +1,225 @@
+#ifndef CENTROID_KDTREE_H
+#define CENTROID_KDTREE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * 4-D kd-tree over the centroids for exact nearest-centroid search at large k (--assign kdtree in the CPU
+ * programs). The tree is rebuilt after every centroid update in O(k log k) with counting sorts on the split
+ * channel. A search starts from the centroid the sample had in the previous iteration, visits the nearer
+ * child first and skips every node whose bounding box is farther than the best distance so far. Ties go
+ * to the lowest centroid index, so the result is the same as the brute-force scan.
+ */
+
+#define CENTROID_TREE_LEAF 8
+
+// Node with the bounding box of its centroids; leaves have left == -1
+struct CentroidNode
+{
+    unsigned char low[4], high[4];
+    int first, count;
+    int left, right;
+};
+
+struct CentroidTree
+{
+    const unsigned char *centroids;
+    int numberOfClusters;
+    int *order;                     // Centroid indices, every node owns order[first .. first + count)
+    int *scratch;
+    struct CentroidNode *nodes;
+    int numberOfNodes;
+};
+
+
+/**
+ *   @brief Recursively builds the node for order[first .. first + count)
+ *
+ *   @param tree tree being built
+ *   @param first first position in order
+ *   @param count number of centroids in the node
+ *
+ *   @return index of the node
+ */
+static int centroid_tree_node(struct CentroidTree *tree, int first, int count)
+{
+    int index = tree->numberOfNodes++;
+    struct CentroidNode *node = &tree->nodes[index];
+    node->first = first;
+    node->count = count;
+    node->left = node->right = -1;
+
+    memset(node->low, 255, 4);
+    memset(node->high, 0, 4);
+    for (int i = first; i < first + count; i++)
+    {
+        const unsigned char *centroid = tree->centroids + tree->order[i] * 4;
+        for (int channel = 0; channel < 4; channel++)
+        {
+            node->low[channel] = centroid[channel] < node->low[channel] ? centroid[channel] : node->low[channel];
+            node->high[channel] = centroid[channel] > node->high[channel] ? centroid[channel] : node->high[channel];
+        }
+    }
+
+    // Split the channel with the largest extent at the median
+    int axis = 0;
+    for (int channel = 1; channel < 4; channel++)
+        if (node->high[channel] - node->low[channel] > node->high[axis] - node->low[axis])
+            axis = channel;
+    if (count <= CENTROID_TREE_LEAF || node->high[axis] == node->low[axis])
+        return index;
+
+    // Stable counting sort of the node's centroids on the split channel
+    int histogram[257] = {0};
+    for (int i = first; i < first + count; i++)
+        histogram[tree->centroids[tree->order[i] * 4 + axis] + 1]++;
+    for (int value = 0; value < 256; value++)
+        histogram[value + 1] += histogram[value];
+    for (int i = first; i < first + count; i++)
+        tree->scratch[first + histogram[tree->centroids[tree->order[i] * 4 + axis]]++] = tree->order[i];
+    memcpy(tree->order + first, tree->scratch + first, count * sizeof(int));
+
+    int half = count / 2;
+    int left = centroid_tree_node(tree, first, half);
+    int right = centroid_tree_node(tree, first + half, count - half);
+    tree->nodes[index].left = left;
+    tree->nodes[index].right = right;
+    return index;
+}
+
+
+/**
+ *   @brief Builds (or rebuilds after a centroid update) the tree over the centroids
+ *
+ *   @param tree tree, zero-initialized before the first call
+ *   @param centroids centroids, 4 bytes each
+ *   @param numberOfClusters number of centroids
+ */
+static void centroid_tree_build(struct CentroidTree *tree, const unsigned char *centroids, int numberOfClusters)
+{
+    if (tree->order == NULL)
+    {
+        tree->order = malloc(numberOfClusters * sizeof(int));
+        tree->scratch = malloc(numberOfClusters * sizeof(int));
+        tree->nodes = malloc(2 * numberOfClusters * sizeof(struct CentroidNode));
+    }
+    tree->centroids = centroids;
+    tree->numberOfClusters = numberOfClusters;
+    tree->numberOfNodes = 0;
+    for (int k = 0; k < numberOfClusters; k++)
+        tree->order[k] = k;
+    centroid_tree_node(tree, 0, numberOfClusters);
+}
+
+
+/**
+ *   @brief Frees the tree
+ *
+ *   @param tree tree built with centroid_tree_build
+ */
+static void centroid_tree_free(struct CentroidTree *tree)
+{
+    free(tree->order);
+    free(tree->scratch);
+    free(tree->nodes);
+    memset(tree, 0, sizeof(*tree));
+}
+
+
+/**
+ *   @brief Returns the squared distance from a sample to the bounding box of a node
+ *
+ *   @param node tree node
+ *   @param sample 4-byte sample
+ *
+ *   @return lower bound of the distance to every centroid in the node
+ */
+static int centroid_node_distance(const struct CentroidNode *node, const unsigned char *sample)
+{
+    int distance = 0;
+    for (int channel = 0; channel < 4; channel++)
+    {
+        int d = sample[channel] < node->low[channel] ? node->low[channel] - sample[channel] :
+                sample[channel] > node->high[channel] ? sample[channel] - node->high[channel] : 0;
+        distance += d * d;
+    }
+    return distance;
+}
+
+
+/**
+ *   @brief Searches a subtree, nearer child first
+ *
+ *   @param tree centroid tree
+ *   @param index node index
+ *   @param sample 4-byte sample
+ *   @param best best squared distance so far, updated
+ *   @param bestIndex centroid index of best, updated
+ */
+static void centroid_tree_search(const struct CentroidTree *tree, int index, const unsigned char *sample, int *best, int *bestIndex)
+{
+    const struct CentroidNode *node = &tree->nodes[index];
+
+    if (node->left < 0)
+    {
+        for (int i = node->first; i < node->first + node->count; i++)
+        {
+            int k = tree->order[i];
+            const unsigned char *centroid = tree->centroids + k * 4;
+            int deviation = (sample[0] - centroid[0]) * (sample[0] - centroid[0]) + (sample[1] - centroid[1]) * (sample[1] - centroid[1]) +
+                            (sample[2] - centroid[2]) * (sample[2] - centroid[2]) + (sample[3] - centroid[3]) * (sample[3] - centroid[3]);
+            if (deviation < *best || (deviation == *best && k < *bestIndex))
+            {
+                *best = deviation;
+                *bestIndex = k;
+            }
+        }
+        return;
+    }
+
+    // Equal bounds are still visited, a lower index at the same distance may be inside
+    int leftDistance = centroid_node_distance(&tree->nodes[node->left], sample);
+    int rightDistance = centroid_node_distance(&tree->nodes[node->right], sample);
+    int nearChild = leftDistance <= rightDistance ? node->left : node->right;
+    int farChild = leftDistance <= rightDistance ? node->right : node->left;
+    int farDistance = leftDistance <= rightDistance ? rightDistance : leftDistance;
+
+    if ((nearChild == node->left ? leftDistance : rightDistance) <= *best)
+        centroid_tree_search(tree, nearChild, sample, best, bestIndex);
+    if (farDistance <= *best)
+        centroid_tree_search(tree, farChild, sample, best, bestIndex);
+}
+
+
+/**
+ *   @brief Returns the exact nearest centroid of a sample (lowest index on ties)
+ *
+ *   @param tree centroid tree
+ *   @param sample 4-byte sample
+ *   @param previous centroid index of the sample in the previous iteration or -1
+ *   @param deviation squared distance to the nearest centroid, set on return
+ *
+ *   @return index of the nearest centroid
+ */
+static int centroid_tree_nearest(const struct CentroidTree *tree, const unsigned char *sample, int previous, int *deviation)
+{
+    int best = INT_MAX;
+    int bestIndex = INT_MAX;
+
+    // The previous centroid is usually still the nearest one and makes the bound tight from the start
+    if (previous >= 0)
+    {
+        const unsigned char *centroid = tree->centroids + previous * 4;
+        best = (sample[0] - centroid[0]) * (sample[0] - centroid[0]) + (sample[1] - centroid[1]) * (sample[1] - centroid[1]) +
+               (sample[2] - centroid[2]) * (sample[2] - centroid[2]) + (sample[3] - centroid[3]) * (sample[3] - centroid[3]);
+        bestIndex = previous;
+    }
+
+    centroid_tree_search(tree, 0, sample, &best, &bestIndex);
+    *deviation = best;
+    return bestIndex;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef COHERENT_ASSIGN_H
+#define COHERENT_ASSIGN_H
+
+#include <string.h>
+#include "pde_assign.h"
+
+/*
+ * Assignment that exploits spatial coherence (--assign coherent in the CPU programs).
+ *
+ * The image is scanned in row order in bands of COHERENT_BAND_ROWS rows (bands run in parallel with
+ * OpenMP). A sample that is bit-identical to its left neighbour takes over the neighbour's centroid
+ * outright. Otherwise the centroids of the left and above neighbours and of the previous iteration are
+ * tried first, and the nearest of them seeds the luma-sorted search of pde_assign.h, whose pruning
+ * rarely has to look at more than a few candidates then. The result is exact (lowest index on ties).
+ */
+
+#define COHERENT_BAND_ROWS 16
+
+
+/**
+ *   @brief Assigns every sample to its nearest centroid, using the neighbours' centroids as starting points
+ *
+ *   @param image raw image data, width * 4 bytes per row
+ *   @param width image width
+ *   @param height image height
+ *   @param centroids centroids, 4 bytes each
+ *   @param index luma-sorted centroids
+ *   @param nearest 4 * centroid index of every sample (the layout of c in the CPU programs); read as the
+ *          previous assignment if havePrevious, set on return
+ *   @param havePrevious whether nearest holds the assignment of the previous iteration
+ *   @param evaluations number of (partial) distance evaluations, incremented
+ *
+ *   @return Sum of squared distances to the nearest centroids (inertia)
+ */
+static long long coherent_assign(const unsigned char *image, int width, int height, const unsigned char *centroids, const struct PdeIndex *index,
+                                 int *nearest, int havePrevious, long long *evaluations)
+{
+    long long inertia = 0;
+    long long count = 0;
+    int numberOfBands = (height + COHERENT_BAND_ROWS - 1) / COHERENT_BAND_ROWS;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for reduction(+ : inertia, count) schedule(dynamic)
+    #endif
+    for (int band = 0; band < numberOfBands; band++)
+    {
+        int firstRow = band * COHERENT_BAND_ROWS;
+        int lastRow = firstRow + COHERENT_BAND_ROWS < height ? firstRow + COHERENT_BAND_ROWS : height;
+
+        for (int y = firstRow; y < lastRow; y++)
+        {
+            int deviation = 0;
+
+            for (int x = 0; x < width; x++)
+            {
+                size_t j = (size_t)y * width + x;
+                const unsigned char *sample = image + j * 4;
+
+                // Same colour as the left neighbour: same centroid and distance
+                if (x > 0 && memcmp(sample, sample - 4, 4) == 0)
+                {
+                    nearest[j] = nearest[j - 1];
+                    inertia += deviation;
+                    continue;
+                }
+
+                // Nearest of the previous, left and above centroids (the above row only within the band)
+                int seeds[3];
+                int numberOfSeeds = 0;
+                if (havePrevious)
+                    seeds[numberOfSeeds++] = nearest[j] / 4;
+                if (x > 0)
+                    seeds[numberOfSeeds++] = nearest[j - 1] / 4;
+                if (y > firstRow)
+                    seeds[numberOfSeeds++] = nearest[j - width] / 4;
+
+                int seed = -1;
+                int seedDeviation = 0;
+                for (int s = 0; s < numberOfSeeds; s++)
+                {
+                    if (s > 0 && seeds[s] == seeds[s - 1])
+                        continue;
+                    const unsigned char *centroid = centroids + seeds[s] * 4;
+                    int d = (sample[0] - centroid[0]) * (sample[0] - centroid[0]) + (sample[1] - centroid[1]) * (sample[1] - centroid[1]) +
+                            (sample[2] - centroid[2]) * (sample[2] - centroid[2]) + (sample[3] - centroid[3]) * (sample[3] - centroid[3]);
+                    count++;
+                    if (seed < 0 || d < seedDeviation || (d == seedDeviation && seeds[s] < seed))
+                    {
+                        seed = seeds[s];
+                        seedDeviation = d;
+                    }
+                }
+
+                nearest[j] = pde_nearest(index, sample, seed, seedDeviation, centroids, &deviation, &count) * 4;
+                inertia += deviation;
+            }
+        }
+    }
+
+    *evaluations += count;
+    return inertia;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef FILTERING_KMEANS_H
+#define FILTERING_KMEANS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Filtering k-means (Kanungo et al., "An efficient k-means clustering algorithm: analysis and
+ * implementation", 2002), used by --assign filter in the CPU programs.
+ *
+ * A kd-tree is built once over the unique colours of the image, every node keeps the weighted sum,
+ * weight and sum of squared norms of its colours. Each iteration walks the tree with a list of candidate
+ * centroids: a candidate that is farther than the centroid nearest to the cell midpoint from every point
+ * of the cell's bounding box is dropped, and once a single candidate is left the whole subtree is assigned
+ * to it at once. Subtrees near the root are walked as OpenMP tasks.
+ */
+
+#define COLOR_TREE_LEAF 8
+#define COLOR_TREE_TASK_DEPTH 8
+
+// Node over colors[first .. first + count); leaves have left == -1
+struct ColorNode
+{
+    unsigned char low[4], high[4];
+    long long sum[4];
+    long long weight;
+    long long squares;
+    int first, count;
+    int left, right;
+};
+
+struct ColorTree
+{
+    const unsigned char *image;     // Samples the tree was built from, not owned
+    size_t numberOfPixels;
+    unsigned char *colors;          // Unique colours, 4 bytes each
+    long long *weights;             // Number of samples of every colour
+    int numberOfColors;
+    struct ColorNode *nodes;
+    int numberOfNodes;
+};
+
+
+/**
+ *   @brief Recursively builds the node for colors[first .. first + count)
+ *
+ *   @param tree tree being built
+ *   @param scratch buffers of count colours and weights used while partitioning
+ *   @param scratchWeights weights matching scratch
+ *   @param first first colour of the node
+ *   @param count number of colours in the node
+ *
+ *   @return index of the node
+ */
+static int color_tree_node(struct ColorTree *tree, unsigned char *scratch, long long *scratchWeights, int first, int count)
+{
+    int index = tree->numberOfNodes++;
+    struct ColorNode *node = &tree->nodes[index];
+    memset(node, 0, sizeof(*node));
+    node->first = first;
+    node->count = count;
+    node->left = node->right = -1;
+    memset(node->low, 255, 4);
+
+    for (int i = first; i < first + count; i++)
+    {
+        const unsigned char *color = tree->colors + (size_t)i * 4;
+        long long weight = tree->weights[i];
+        for (int channel = 0; channel < 4; channel++)
+        {
+            node->low[channel] = color[channel] < node->low[channel] ? color[channel] : node->low[channel];
+            node->high[channel] = color[channel] > node->high[channel] ? color[channel] : node->high[channel];
+            node->sum[channel] += color[channel] * weight;
+            node->squares += (long long)color[channel] * color[channel] * weight;
+        }
+        node->weight += weight;
+    }
+
+    // Split the channel with the largest extent at the median
+    int axis = 0;
+    for (int channel = 1; channel < 4; channel++)
+        if (node->high[channel] - node->low[channel] > node->high[axis] - node->low[axis])
+            axis = channel;
+    if (count <= COLOR_TREE_LEAF || node->high[axis] == node->low[axis])
+        return index;
+
+    // Stable counting sort of the node's colours on the split channel
+    int histogram[257] = {0};
+    for (int i = first; i < first + count; i++)
+        histogram[tree->colors[(size_t)i * 4 + axis] + 1]++;
+    for (int value = 0; value < 256; value++)
+        histogram[value + 1] += histogram[value];
+    for (int i = first; i < first + count; i++)
+    {
+        int position = histogram[tree->colors[(size_t)i * 4 + axis]]++;
+        memcpy(scratch + (size_t)position * 4, tree->colors + (size_t)i * 4, 4);
+        scratchWeights[position] = tree->weights[i];
+    }
+    memcpy(tree->colors + (size_t)first * 4, scratch, (size_t)count * 4);
+    memcpy(tree->weights + first, scratchWeights, count * sizeof(long long));
+
+    int half = count / 2;
+    int left = color_tree_node(tree, scratch, scratchWeights, first, half);
+    int right = color_tree_node(tree, scratch, scratchWeights, first + half, count - half);
+    tree->nodes[index].left = left;
+    tree->nodes[index].right = right;
+    return index;
+}
+
+
+/**
+ *   @brief Builds the tree over the unique colours of an image
+ *
+ *   @param tree tree, set on return
+ *   @param image raw image data, 4 bytes per sample
+ *   @param numberOfPixels number of samples
+ */
+static void color_tree_build(struct ColorTree *tree, const unsigned char *image, size_t numberOfPixels)
+{
+    // Radix sort of the samples as 32-bit values groups equal colours
+    uint32_t *keys = malloc(numberOfPixels * sizeof(uint32_t));
+    uint32_t *sorted = malloc(numberOfPixels * sizeof(uint32_t));
+    memcpy(keys, image, numberOfPixels * sizeof(uint32_t));
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        size_t histogram[257] = {0};
+        for (size_t i = 0; i < numberOfPixels; i++)
+            histogram[((keys[i] >> shift) & 255) + 1]++;
+        for (int value = 0; value < 256; value++)
+            histogram[value + 1] += histogram[value];
+        for (size_t i = 0; i < numberOfPixels; i++)
+            sorted[histogram[(keys[i] >> shift) & 255]++] = keys[i];
+        uint32_t *swap = keys;
+        keys = sorted;
+        sorted = swap;
+    }
+
+    int numberOfColors = 0;
+    for (size_t i = 0; i < numberOfPixels; i++)
+        numberOfColors += i == 0 || keys[i] != keys[i - 1];
+
+    tree->image = image;
+    tree->numberOfPixels = numberOfPixels;
+    tree->colors = malloc((size_t)numberOfColors * 4);
+    tree->weights = calloc(numberOfColors, sizeof(long long));
+    tree->numberOfColors = numberOfColors;
+    for (size_t i = 0, color = 0; i < numberOfPixels; i++)
+    {
+        if (i > 0 && keys[i] != keys[i - 1])
+            color++;
+        memcpy(tree->colors + color * 4, &keys[i], 4);
+        tree->weights[color]++;
+    }
+    free(keys);
+    free(sorted);
+
+    tree->nodes = malloc(2 * (size_t)numberOfColors * sizeof(struct ColorNode));
+    tree->numberOfNodes = 0;
+    unsigned char *scratch = malloc((size_t)numberOfColors * 4);
+    long long *scratchWeights = malloc(numberOfColors * sizeof(long long));
+    color_tree_node(tree, scratch, scratchWeights, 0, numberOfColors);
+    free(scratch);
+    free(scratchWeights);
+}
+
+
+/**
+ *   @brief Frees the tree
+ *
+ *   @param tree tree built with color_tree_build
+ */
+static void color_tree_free(struct ColorTree *tree)
+{
+    free(tree->colors);
+    free(tree->weights);
+    free(tree->nodes);
+    memset(tree, 0, sizeof(*tree));
+}
+
+
+/**
+ *   @brief Returns the squared distance between a colour and a centroid
+ *
+ *   @param color 4-byte colour
+ *   @param centroid 4-byte centroid
+ *
+ *   @return squared Euclidean distance
+ */
+static int color_distance(const unsigned char *color, const unsigned char *centroid)
+{
+    return (color[0] - centroid[0]) * (color[0] - centroid[0]) + (color[1] - centroid[1]) * (color[1] - centroid[1]) +
+           (color[2] - centroid[2]) * (color[2] - centroid[2]) + (color[3] - centroid[3]) * (color[3] - centroid[3]);
+}
+
+
+/**
+ *   @brief Adds weighted colours to a cluster
+ *
+ *   @param totals per cluster RGBA sums and weights (numberOfClusters * 5) followed by the inertia
+ *   @param numberOfClusters number of centroids
+ *   @param k cluster index
+ *   @param sum weighted RGBA sums of the colours
+ *   @param weight total weight of the colours
+ *   @param deviation sum of weighted squared distances to centroid k
+ */
+static void color_tree_add(long long *totals, int numberOfClusters, int k, const long long *sum, long long weight, long long deviation)
+{
+    for (int channel = 0; channel < 4; channel++)
+    {
+        #ifdef _OPENMP
+        #pragma omp atomic update
+        #endif
+        totals[k * 4 + channel] += sum[channel];
+    }
+    #ifdef _OPENMP
+    #pragma omp atomic update
+    #endif
+    totals[numberOfClusters * 4 + k] += weight;
+    #ifdef _OPENMP
+    #pragma omp atomic update
+    #endif
+    totals[numberOfClusters * 5] += deviation;
+}
+
+
+/**
+ *   @brief Filters the candidates of a node and assigns its colours
+ *
+ *   @param tree colour tree
+ *   @param index node index
+ *   @param centroids centroids, 4 bytes each
+ *   @param numberOfClusters number of centroids
+ *   @param candidates candidate centroid indices in increasing order
+ *   @param numberOfCandidates number of candidates
+ *   @param totals accumulated sums, weights and inertia (see color_tree_add)
+ *   @param depth depth of the node
+ */
+static void color_tree_filter(const struct ColorTree *tree, int index, const unsigned char *centroids, int numberOfClusters,
+                              const int *candidates, int numberOfCandidates, long long *totals, int depth)
+{
+    const struct ColorNode *node = &tree->nodes[index];
+
+    // Candidate nearest to the cell midpoint (doubled coordinates keep it integer)
+    int nearest = candidates[0];
+    long long nearestDistance = -1;
+    for (int c = 0; c < numberOfCandidates; c++)
+    {
+        const unsigned char *centroid = centroids + candidates[c] * 4;
+        long long distance = 0;
+        for (int channel = 0; channel < 4; channel++)
+        {
+            int d = 2 * centroid[channel] - node->low[channel] - node->high[channel];
+            distance += d * d;
+        }
+        if (nearestDistance < 0 || distance < nearestDistance)
+        {
+            nearestDistance = distance;
+            nearest = candidates[c];
+        }
+    }
+
+    // Drop candidates that are strictly farther than nearest from every point of the cell: it suffices to check
+    // the corner of the box that lies furthest in the direction from nearest to the candidate. The list lives
+    // on the stack (at most k entries) and outlasts the child tasks, which finish before the taskwait below
+    int filtered[numberOfCandidates];
+    int numberOfFiltered = 0;
+    const unsigned char *best = centroids + nearest * 4;
+    for (int c = 0; c < numberOfCandidates; c++)
+    {
+        const unsigned char *centroid = centroids + candidates[c] * 4;
+        unsigned char corner[4];
+        for (int channel = 0; channel < 4; channel++)
+            corner[channel] = centroid[channel] > best[channel] ? node->high[channel] : node->low[channel];
+        if (candidates[c] == nearest || color_distance(corner, centroid) <= color_distance(corner, best))
+            filtered[numberOfFiltered++] = candidates[c];
+    }
+
+    if (numberOfFiltered == 1)
+    {
+        // The whole subtree belongs to one cluster: sum |x - z|^2 = squares - 2 z.sum + weight |z|^2
+        long long deviation = node->squares;
+        for (int channel = 0; channel < 4; channel++)
+            deviation += -2 * best[channel] * node->sum[channel] + node->weight * best[channel] * best[channel];
+        color_tree_add(totals, numberOfClusters, nearest, node->sum, node->weight, deviation);
+    }
+    else if (node->left < 0)
+    {
+        // Leaf: assign every colour, ties to the lowest index
+        for (int i = node->first; i < node->first + node->count; i++)
+        {
+            const unsigned char *color = tree->colors + (size_t)i * 4;
+            int k = filtered[0];
+            int minDeviation = color_distance(color, centroids + k * 4);
+            for (int c = 1; c < numberOfFiltered; c++)
+            {
+                int deviation = color_distance(color, centroids + filtered[c] * 4);
+                if (deviation < minDeviation)
+                {
+                    minDeviation = deviation;
+                    k = filtered[c];
+                }
+            }
+            long long weight = tree->weights[i];
+            long long sum[4] = {color[0] * weight, color[1] * weight, color[2] * weight, color[3] * weight};
+            color_tree_add(totals, numberOfClusters, k, sum, weight, minDeviation * weight);
+        }
+    }
+    else
+    {
+        if (depth < COLOR_TREE_TASK_DEPTH)
+        {
+            #ifdef _OPENMP
+            #pragma omp task shared(filtered)
+            #endif
+            color_tree_filter(tree, node->left, centroids, numberOfClusters, filtered, numberOfFiltered, totals, depth + 1);
+        }
+        else
+        {
+            color_tree_filter(tree, node->left, centroids, numberOfClusters, filtered, numberOfFiltered, totals, depth + 1);
+        }
+        color_tree_filter(tree, node->right, centroids, numberOfClusters, filtered, numberOfFiltered, totals, depth + 1);
+        #ifdef _OPENMP
+        #pragma omp taskwait
+        #endif
+    }
+}
+
+
+/**
+ *   @brief Runs k-means iterations with the filtering algorithm
+ *
+ *   @param tree colour tree of the image
+ *   @param centroids initial centroids, 4 bytes each, updated in place
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations maximum number of iterations
+ *   @param maxShift stop once no centroid channel moves by more than this, -1 to run all iterations
+ *   @param numberOfIterationsRun number of iterations run, set on return if not NULL
+ *
+ *   @return Sum of squared distances of the last assignment (inertia)
+ */
+static long long filtering_kmeans(const struct ColorTree *tree, unsigned char *centroids, int numberOfClusters, int numberOfIterations, int maxShift,
+                                  int *numberOfIterationsRun)
+{
+    long long *totals = malloc((numberOfClusters * 5 + 1) * sizeof(long long));
+    int *candidates = malloc(numberOfClusters * sizeof(int));
+    long long inertia = 0;
+    for (int k = 0; k < numberOfClusters; k++)
+        candidates[k] = k;
+
+    int i = 0;
+    while (i < numberOfIterations)
+    {
+        memset(totals, 0, (numberOfClusters * 5 + 1) * sizeof(long long));
+
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        #ifdef _OPENMP
+        #pragma omp single
+        #endif
+        color_tree_filter(tree, 0, centroids, numberOfClusters, candidates, numberOfClusters, totals, 0);
+
+        inertia = totals[numberOfClusters * 5];
+
+        // New centroids; an empty cluster gets a random sample of the image, drawn as in the brute-force iterations
+        int shift = 0;
+        for (int k = 0; k < numberOfClusters; k++)
+        {
+            long long weight = totals[numberOfClusters * 4 + k];
+            unsigned char previous[4];
+            memcpy(previous, centroids + k * 4, 4);
+            if (weight == 0)
+            {
+                int max = (long long)tree->numberOfPixels < RAND_MAX ? (int)tree->numberOfPixels : RAND_MAX;
+                memcpy(centroids + k * 4, tree->image + (size_t)(rand() % max) * 4, 4);
+            }
+            else
+                for (int channel = 0; channel < 4; channel++)
+                    centroids[k * 4 + channel] = totals[k * 4 + channel] / weight;
+            for (int channel = 0; channel < 4; channel++)
+                shift = abs(centroids[k * 4 + channel] - previous[channel]) > shift ? abs(centroids[k * 4 + channel] - previous[channel]) : shift;
+        }
+
+        i++;
+        if (maxShift >= 0 && shift <= maxShift)
+            break;
+    }
+
+    if (numberOfIterationsRun != NULL)
+        *numberOfIterationsRun = i;
+
+    free(totals);
+    free(candidates);
+    return inertia;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef GEMM_ASSIGN_H
+#define GEMM_ASSIGN_H
+
+#include <stdlib.h>
+#include <limits.h>
+
+/*
+ * Nearest-centroid assignment as a blocked matrix product (--assign gemm in the CPU programs).
+ *
+ * |x - c|^2 = |x|^2 - 2 x.c + |c|^2, and |x|^2 does not change the argmin, so for every sample the kernel
+ * only minimizes |c|^2 - 2 x.c. Samples are processed in tiles of GEMM_PIXEL_TILE, transposed into one
+ * array per channel so the inner loop runs over consecutive samples (and vectorizes), and every pass
+ * over a tile handles GEMM_CENTROID_BLOCK centroids kept in registers. The last tile is padded with zero
+ * samples, so every inner loop has the same fixed trip count and is vectorized at -O2 as well. The
+ * arithmetic is exact 32-bit integer math and centroids are visited in increasing order with a strict
+ * comparison, so the result is identical to the per-sample scan, ties included.
+ */
+
+#define GEMM_PIXEL_TILE 256
+#define GEMM_CENTROID_BLOCK 4
+
+
+/**
+ *   @brief Folds one centroid into the running minimum of a tile
+ *
+ *   @param x sample channels of the tile, GEMM_PIXEL_TILE values per channel
+ *   @param weights centroid channels multiplied by -2
+ *   @param norm squared norm of the centroid
+ *   @param index centroid index
+ *   @param best smallest |c|^2 - 2 x.c so far, updated
+ *   @param bestIndex centroid index of best, updated
+ */
+static void gemm_fold(int x[4][GEMM_PIXEL_TILE], const int *weights, int norm, int index, int *best, int *bestIndex)
+{
+    for (int p = 0; p < GEMM_PIXEL_TILE; p++)
+    {
+        int d = norm + weights[0] * x[0][p] + weights[1] * x[1][p] + weights[2] * x[2][p] + weights[3] * x[3][p];
+        int better = d < best[p];
+        best[p] = better ? d : best[p];
+        bestIndex[p] = better ? index : bestIndex[p];
+    }
+}
+
+
+/**
+ *   @brief Assigns every sample to its nearest centroid
+ *
+ *   @param samples raw samples, 4 bytes each
+ *   @param numberOfSamples number of samples
+ *   @param centroids centroids, 4 bytes each
+ *   @param numberOfClusters number of centroids
+ *   @param nearest index of the nearest centroid of every sample, set on return
+ *
+ *   @return Sum of squared distances to the nearest centroids (inertia)
+ */
+static long long gemm_assign(const unsigned char *samples, size_t numberOfSamples, const unsigned char *centroids, int numberOfClusters, int *nearest)
+{
+    // Centroids as -2c and |c|^2, GEMM_CENTROID_BLOCK of them at a time
+    int *weights = malloc(numberOfClusters * 4 * sizeof(int));
+    int *norms = malloc(numberOfClusters * sizeof(int));
+    for (int k = 0; k < numberOfClusters; k++)
+    {
+        norms[k] = 0;
+        for (int channel = 0; channel < 4; channel++)
+        {
+            weights[k * 4 + channel] = -2 * centroids[k * 4 + channel];
+            norms[k] += centroids[k * 4 + channel] * centroids[k * 4 + channel];
+        }
+    }
+
+    long long inertia = 0;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for reduction(+ : inertia) schedule(static)
+    #endif
+    for (size_t tile = 0; tile < numberOfSamples; tile += GEMM_PIXEL_TILE)
+    {
+        int count = numberOfSamples - tile < GEMM_PIXEL_TILE ? numberOfSamples - tile : GEMM_PIXEL_TILE;
+        int x[4][GEMM_PIXEL_TILE];
+        int best[GEMM_PIXEL_TILE];
+        int bestIndex[GEMM_PIXEL_TILE];
+
+        // Transpose the tile into one array per channel
+        for (int p = 0; p < GEMM_PIXEL_TILE; p++)
+        {
+            for (int channel = 0; channel < 4; channel++)
+                x[channel][p] = p < count ? samples[(tile + p) * 4 + channel] : 0;
+            best[p] = INT_MAX;
+            bestIndex[p] = 0;
+        }
+
+        int k = 0;
+        for (; k + GEMM_CENTROID_BLOCK <= numberOfClusters; k += GEMM_CENTROID_BLOCK)
+        {
+            // Register block of four centroids, folded in increasing order so ties keep the lowest index
+            const int *w0 = weights + k * 4, *w1 = w0 + 4, *w2 = w0 + 8, *w3 = w0 + 12;
+            int n0 = norms[k], n1 = norms[k + 1], n2 = norms[k + 2], n3 = norms[k + 3];
+
+            for (int p = 0; p < GEMM_PIXEL_TILE; p++)
+            {
+                int x0 = x[0][p], x1 = x[1][p], x2 = x[2][p], x3 = x[3][p];
+                int d0 = n0 + w0[0] * x0 + w0[1] * x1 + w0[2] * x2 + w0[3] * x3;
+                int d1 = n1 + w1[0] * x0 + w1[1] * x1 + w1[2] * x2 + w1[3] * x3;
+                int d2 = n2 + w2[0] * x0 + w2[1] * x1 + w2[2] * x2 + w2[3] * x3;
+                int d3 = n3 + w3[0] * x0 + w3[1] * x1 + w3[2] * x2 + w3[3] * x3;
+
+                int b = best[p], i = bestIndex[p];
+                i = d0 < b ? k : i;
+                b = d0 < b ? d0 : b;
+                i = d1 < b ? k + 1 : i;
+                b = d1 < b ? d1 : b;
+                i = d2 < b ? k + 2 : i;
+                b = d2 < b ? d2 : b;
+                i = d3 < b ? k + 3 : i;
+                b = d3 < b ? d3 : b;
+                best[p] = b;
+                bestIndex[p] = i;
+            }
+        }
+        for (; k < numberOfClusters; k++)
+            gemm_fold(x, weights + k * 4, norms[k], k, best, bestIndex);
+
+        // Fused argmin output, the distance gets |x|^2 back
+        for (int p = 0; p < count; p++)
+        {
+            nearest[tile + p] = bestIndex[p];
+            inertia += best[p] + x[0][p] * x[0][p] + x[1][p] * x[1][p] + x[2][p] * x[2][p] + x[3][p] * x[3][p];
+        }
+    }
+
+    free(weights);
+    free(norms);
+    return inertia;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef IMAGE_LOAD_H
+#define IMAGE_LOAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include "FreeImage.h"
+
+/*
+ * Input helpers shared by CPU_Sequential.c, CPU_OpenMP.c and GPU_OpenCL.c. Images are returned as
+ * top-down raw 32-bit data (B, G, R, A per pixel), the layout the k-means code works on.
+ */
+
+
+/**
+ *   @brief Detects the format of an image file from its contents, then from its extension
+ *
+ *   @param fileName image file name
+ *
+ *   @return FreeImage format or FIF_UNKNOWN if the file cannot be read
+ */
+static FREE_IMAGE_FORMAT image_format(const char *fileName)
+{
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileType(fileName, 0);
+    if (format == FIF_UNKNOWN)
+        format = FreeImage_GetFIFFromFilename(fileName);
+    if (format != FIF_UNKNOWN && !FreeImage_FIFSupportsReading(format))
+        format = FIF_UNKNOWN;
+    return format;
+}
+
+
+/**
+ *   @brief Copies a bitmap into newly allocated top-down 32-bit raw data and unloads it
+ *
+ *   @param bitmap loaded bitmap of any bit depth
+ *   @param width image width, set on return
+ *   @param height image height, set on return
+ *   @param pitch bytes per row, set on return
+ *
+ *   @return Raw image data (caller frees)
+ */
+static unsigned char *image_raw_bits(FIBITMAP *bitmap, int *width, int *height, int *pitch)
+{
+    FIBITMAP *bitmap32 = FreeImage_ConvertTo32Bits(bitmap);
+
+    *width = FreeImage_GetWidth(bitmap32);
+    *height = FreeImage_GetHeight(bitmap32);
+    *pitch = FreeImage_GetPitch(bitmap32);
+
+    unsigned char *image = (unsigned char *)malloc((size_t)*height * *pitch);
+    FreeImage_ConvertToRawBits(image, bitmap32, *pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+
+    FreeImage_Unload(bitmap32);
+    FreeImage_Unload(bitmap);
+    return image;
+}
+
+
+/**
+ *   @brief Loads a PNG, JPEG, TIFF, BMP, WebP, PPM or any other image FreeImage can read
+ *
+ *   @param fileName image file name
+ *   @param width image width, set on success
+ *   @param height image height, set on success
+ *   @param pitch bytes per row, set on success
+ *
+ *   @return Raw image data (caller frees) or NULL if the file cannot be loaded
+ */
+static unsigned char *load_image_file(const char *fileName, int *width, int *height, int *pitch)
+{
+    FREE_IMAGE_FORMAT format = image_format(fileName);
+    if (format == FIF_UNKNOWN)
+        return NULL;
+
+    FIBITMAP *bitmap = FreeImage_Load(format, fileName, 0);
+    if (!bitmap)
+        return NULL;
+    return image_raw_bits(bitmap, width, height, pitch);
+}
+
+
+/**
+ *   @brief Returns a copy of an image reduced by scale in both directions, used only to train centroids
+ *
+ *   JPEG files are decoded again at reduced size (DCT scaling with JPEG_FAST), which costs a fraction of
+ *   the full decode; other images are box-filtered from the full resolution data.
+ *
+ *   @param fileName image file name
+ *   @param image full resolution raw data of the same file
+ *   @param width full image width
+ *   @param height full image height
+ *   @param pitch bytes per row of image
+ *   @param scale reduction factor (> 1)
+ *   @param trainWidth width of the reduced image, set on return
+ *   @param trainHeight height of the reduced image, set on return
+ *
+ *   @return Raw data of the reduced image (caller frees), rows are trainWidth * 4 bytes
+ */
+static inline unsigned char *load_training_image(const char *fileName, unsigned char *image, int width, int height, int pitch, int scale,
+                                          int *trainWidth, int *trainHeight)
+{
+    int targetWidth = width / scale > 0 ? width / scale : 1;
+    int targetHeight = height / scale > 0 ? height / scale : 1;
+    int trainPitch;
+
+    if (image_format(fileName) == FIF_JPEG)
+    {
+        // The size in the upper 16 bits asks the JPEG plugin for the smallest DCT scale that still covers it
+        int size = targetWidth > targetHeight ? targetWidth : targetHeight;
+        FIBITMAP *bitmap = FreeImage_Load(FIF_JPEG, fileName, JPEG_FAST | (size << 16));
+        if (bitmap)
+        {
+            if ((int)FreeImage_GetWidth(bitmap) != targetWidth || (int)FreeImage_GetHeight(bitmap) != targetHeight)
+            {
+                FIBITMAP *rescaled = FreeImage_Rescale(bitmap, targetWidth, targetHeight, FILTER_BOX);
+                FreeImage_Unload(bitmap);
+                bitmap = rescaled;
+            }
+            return image_raw_bits(bitmap, trainWidth, trainHeight, &trainPitch);
+        }
+    }
+
+    FIBITMAP *bitmap = FreeImage_ConvertFromRawBits(image, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+    FIBITMAP *rescaled = FreeImage_Rescale(bitmap, targetWidth, targetHeight, FILTER_BOX);
+    FreeImage_Unload(bitmap);
+    return image_raw_bits(rescaled, trainWidth, trainHeight, &trainPitch);
+}
+
+
+/**
+ *   @brief Compares two file names for qsort
+ *
+ *   @param a pointer to the first name
+ *   @param b pointer to the second name
+ *
+ *   @return strcmp order of the names
+ */
+static inline int image_name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/**
+ *   @brief Lists the PNG files of a directory in name order (frames of a sequence)
+ *
+ *   @param directory directory name
+ *   @param count number of files, set on return
+ *
+ *   @return Paths of the files (caller frees every path and the array) or NULL if the directory cannot be read or
+ *           holds no PNG files (count is then 0)
+ */
+static inline char **list_png_files(const char *directory, int *count)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+        return NULL;
+
+    char **names = NULL;
+    int capacity = 0;
+    *count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (length < 5 || strcasecmp(entry->d_name + length - 4, ".png") != 0)
+            continue;
+        if (*count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            names = realloc(names, capacity * sizeof(char *));
+        }
+        names[*count] = malloc(strlen(directory) + length + 2);
+        sprintf(names[(*count)++], "%s/%s", directory, entry->d_name);
+    }
+    closedir(dir);
+
+    // qsort must not get a NULL array, even for zero elements
+    if (names == NULL)
+        return NULL;
+    qsort(names, *count, sizeof(char *), image_name_compare);
+    return names;
+}
+
+#endif
@@ -2,7 +2,23 @@ struct Point {
     int r, g, b, a;
 };
 
+// The host may specialize the program with -DK=<clusters> -DCHANNELS=<3|4>. Then the centroid loop
+// has a constant trip count and local arrays are statically sized instead of passed as arguments.
+#ifdef K
+#define NUMBER_OF_CLUSTERS K
+#define LOCAL_BUFFERS
+#else
+#define NUMBER_OF_CLUSTERS numberOfClusters
+#define LOCAL_BUFFERS , __local struct Point *localSum, __local int *localN
+#endif
+
+// With 3 channels every pixel is opaque, so alpha is neither compared nor accumulated
+#ifndef CHANNELS
+#define CHANNELS 4
+#endif
+
 int euclidean_distance(struct Point pointA, struct Point pointB);
+void add_inertia(__global uint *inertia, uint value);
 int random_integer(ulong seed, int min, int max);
 
 __kernel void initialize_values(__global unsigned char *image, 
@@ -34,24 +50,45 @@ __kernel void arrange_in_clusters(__global unsigned char *image,
                                 __global int *c,
                                 __global struct Point *globalSum,
                                 __global int *globalN,
-                                int numberOfClusters,
-                                __local struct Point *localSum,
-                                __local int *localN)
+                                __global int *changed,
+                                __global uint *inertia,
+                                int iteration,
+                                int threshold,
+                                int numberOfClusters
+                                LOCAL_BUFFERS)
 {
+#ifdef K
+    __local struct Point localSum[K];
+    __local int localN[K];
+#endif
+    __local int localChanged;
+    __local uint localInertia;
     int globalID = get_global_id(0);
+    int localID = get_local_id(0);
+    int localSize = get_local_size(0);
 
-    if(globalID < width * height) {
-        int localID = get_local_id(0);
-
-        // Initialize local variables
-        if(localID < numberOfClusters) {
-            struct Point point = {0, 0, 0, 0};
-            localSum[localID] = point;
-            localN[localID] = 0;
+    // Converged in an earlier iteration: this launch was enqueued speculatively, so skip it (same for every work item)
+    if(iteration > 0 && changed[iteration - 1] <= threshold) {
+        if(globalID == 0) {
+            changed[iteration] = 0;
         }
+        return;
+    }
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+    // Initialize local variables (barriers must be reached by every work item, also past the last pixel)
+    for(int k = localID; k < NUMBER_OF_CLUSTERS; k += localSize) {
+        struct Point point = {0, 0, 0, 0};
+        localSum[k] = point;
+        localN[k] = 0;
+    }
+    if(localID == 0) {
+        localChanged = 0;
+        localInertia = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
 
+    if(globalID < width * height) {
         // Find nearest centroid
         int base = globalID * 4;
         struct Point pointA = {image[base + 2], image[base + 1], image[base + 0], image[base + 3]};
@@ -61,7 +98,10 @@ __kernel void arrange_in_clusters(__global unsigned char *image,
         int nearestCentroidIndex = 0;
         
         // Loop through centroids
-        for(int k = 1; k < numberOfClusters; k++) {
+#ifdef K
+        #pragma unroll
+#endif
+        for(int k = 1; k < NUMBER_OF_CLUSTERS; k++) {
             pointB = centroids[k];
 
             // Find eucledian distance between two samples (deviation between two colors)
@@ -74,29 +114,49 @@ __kernel void arrange_in_clusters(__global unsigned char *image,
             }
         }
         // At this point we have found cetroid nearest to pointA, so we store its index at corresponding position
+        if(c[globalID] != nearestCentroidIndex) {
+            atomic_inc(&localChanged);
+        }
         c[globalID] = nearestCentroidIndex;
+        atomic_add(&localInertia, minDeviation);
 
         // Because we added one more sample to the cluster, we need to add it's RGBA values to the existing sum
         atomic_add(&localSum[nearestCentroidIndex].r, pointA.r);
         atomic_add(&localSum[nearestCentroidIndex].g, pointA.g);
         atomic_add(&localSum[nearestCentroidIndex].b, pointA.b);
+#if CHANNELS == 4
         atomic_add(&localSum[nearestCentroidIndex].a, pointA.a);
+#endif
 
         // New element is added to cluster, so we increase the number of elements in that specific cluster (nearestCentroidIndex)
         atomic_inc(&localN[nearestCentroidIndex]);
+    }
 
-        // Wait for all local threads
-        barrier(CLK_LOCAL_MEM_FENCE);
+    // Wait for all local threads
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        // Copy data to global variable
-        if(localID < numberOfClusters) {
-            atomic_add(&globalSum[localID].r, localSum[localID].r);
-            atomic_add(&globalSum[localID].g, localSum[localID].g);
-            atomic_add(&globalSum[localID].b, localSum[localID].b);
-            atomic_add(&globalSum[localID].a, localSum[localID].a);
-            atomic_add(&globalN[localID], localN[localID]);
+    // Copy data to global variable
+    for(int k = localID; k < NUMBER_OF_CLUSTERS; k += localSize) {
+        if(localN[k] > 0) {
+            atomic_add(&globalSum[k].r, localSum[k].r);
+            atomic_add(&globalSum[k].g, localSum[k].g);
+            atomic_add(&globalSum[k].b, localSum[k].b);
+#if CHANNELS == 4
+            atomic_add(&globalSum[k].a, localSum[k].a);
+#endif
+            atomic_add(&globalN[k], localN[k]);
         }
     }
+
+    // Count samples that moved to another cluster in this iteration
+    if(localID == 0 && localChanged > 0) {
+        atomic_add(&changed[iteration], localChanged);
+    }
+
+    // Sum of squared distances of this iteration (two words per iteration)
+    if(localID == 0 && localInertia > 0) {
+        add_inertia(&inertia[iteration * 2], localInertia);
+    }
 }
 
 __kernel void update_centroid_values(__global unsigned char *image,
@@ -106,11 +166,25 @@ __kernel void update_centroid_values(__global unsigned char *image,
                                     __global struct Point *globalSum,
                                     __global int *globalN,
                                     int numberOfClusters,
-                                    ulong randoms) 
+                                    ulong randoms,
+                                    __global int *changed,
+                                    int iteration,
+                                    int threshold,
+                                    __global struct Point *history) 
 {
     int globalID = get_global_id(0);
+
+    // Skipped together with arrange_in_clusters of the same iteration
+    if(iteration > 0 && changed[iteration - 1] <= threshold) {
+        return;
+    }
     
     if(globalID < numberOfClusters) {
+        // Keep the centroids this iteration was measured with, so the host can return the best ones (time budget)
+        if(history) {
+            history[iteration * numberOfClusters + globalID] = centroids[globalID];
+        }
+
         // If there is no elements in the cluster, we append one random sample
         if(globalN[globalID] == 0) {
             int min = 0;
@@ -131,7 +205,16 @@ __kernel void update_centroid_values(__global unsigned char *image,
         centroids[globalID].r = globalSum[globalID].r / sampleCount;
         centroids[globalID].g = globalSum[globalID].g / sampleCount;
         centroids[globalID].b = globalSum[globalID].b / sampleCount;
+#if CHANNELS == 4
         centroids[globalID].a = globalSum[globalID].a / sampleCount;
+#else
+        centroids[globalID].a = 255;
+#endif
+
+        // Clear sums for the next iteration
+        struct Point zero = {0, 0, 0, 0};
+        globalSum[globalID] = zero;
+        globalN[globalID] = 0;
     }
 }
 
@@ -157,6 +240,31 @@ __kernel void rebuild_image(__global unsigned char *image,
 }
 
 
+// Pack cluster indices into bytes, so only a quarter of the RGBA image has to be read back (k <= 256)
+__kernel void pack_indices(__global int *c,
+                           __global uchar *indices,
+                           int numberOfPixels)
+{
+    int globalID = get_global_id(0);
+
+    if(globalID < numberOfPixels) {
+        indices[globalID] = c[globalID];
+    }
+}
+
+// Same as pack_indices for k > 256
+__kernel void pack_indices16(__global int *c,
+                             __global ushort *indices,
+                             int numberOfPixels)
+{
+    int globalID = get_global_id(0);
+
+    if(globalID < numberOfPixels) {
+        indices[globalID] = c[globalID];
+    }
+}
+
+
 /**
  *   @brief Returns Euclidean distance between two points 
  *
@@ -168,8 +276,25 @@ __kernel void rebuild_image(__global unsigned char *image,
 int euclidean_distance(struct Point pointA, struct Point pointB) {
     return (pointA.r - pointB.r) * (pointA.r - pointB.r) + 
            (pointA.g - pointB.g) * (pointA.g - pointB.g) + 
-           (pointA.b - pointB.b) * (pointA.b - pointB.b) + 
-           (pointA.a - pointB.a) * (pointA.a - pointB.a);
+#if CHANNELS == 4
+           (pointA.a - pointB.a) * (pointA.a - pointB.a) +
+#endif
+           (pointA.b - pointB.b) * (pointA.b - pointB.b);
+}
+
+
+/**
+ *   @brief Adds to a 64-bit sum stored as two 32-bit words, using only 32-bit atomics
+ *
+ *   @param inertia low and high word of the sum
+ *   @param value value to add
+ */
+void add_inertia(__global uint *inertia, uint value) {
+    // The addition that wraps the low word carries into the high word
+    uint old = atomic_add(&inertia[0], value);
+    if(old > UINT_MAX - value) {
+        atomic_inc(&inertia[1]);
+    }
 }
 
 
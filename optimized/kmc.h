@@ -0,0 +1,496 @@
+#ifndef KMC_H
+#define KMC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * KMC: palette + index map container written by the k-means programs (*.kmc).
+ *
+ * Layout (little-endian):
+ *   "KMC1", u32 width, u32 height, u32 numberOfColors, u8 bitsPerIndex, 3 reserved bytes,
+ *   u32 numberOfBands, u32 rowsPerBand, u64 size of every band,
+ *   palette (B, G, R, A per entry), band data.
+ *
+ * Rows are grouped into bands that are encoded and decoded independently (in parallel with OpenMP).
+ * Every row starts on a byte boundary with a mode byte:
+ *   KMC_ROW_PACKED  width indices of bitsPerIndex bits each,
+ *   KMC_ROW_RLE     runs of (index in bitsPerIndex bits, run length as order-0 exp-Golomb code);
+ * the encoder keeps whichever is smaller. Unused bits at the end of a row are zero.
+ */
+
+#define KMC_ROWS_PER_BAND 64
+#define KMC_HEADER_SIZE 28
+#define KMC_ROW_PACKED 0
+#define KMC_ROW_RLE 1
+
+// Growable byte buffer with a bit writer
+struct KmcBuffer
+{
+    unsigned char *data;
+    size_t size, capacity;
+    unsigned long long bits;
+    int numberOfBits;
+};
+
+// Bit reader over one band
+struct KmcReader
+{
+    const unsigned char *data;
+    size_t size, position;
+    unsigned long long bits;
+    int numberOfBits;
+};
+
+
+/**
+ *   @brief Appends the lowest count bits of value, most significant first
+ *
+ *   @param buffer output buffer
+ *   @param value bits to write
+ *   @param count number of bits (at most 32)
+ */
+static void kmc_put_bits(struct KmcBuffer *buffer, unsigned int value, int count)
+{
+    buffer->bits = (buffer->bits << count) | (value & (unsigned int)((1ULL << count) - 1));
+    buffer->numberOfBits += count;
+
+    while (buffer->numberOfBits >= 8)
+    {
+        if (buffer->size == buffer->capacity)
+        {
+            buffer->capacity = buffer->capacity ? 2 * buffer->capacity : 4096;
+            buffer->data = realloc(buffer->data, buffer->capacity);
+        }
+        buffer->numberOfBits -= 8;
+        buffer->data[buffer->size++] = buffer->bits >> buffer->numberOfBits;
+    }
+}
+
+
+/**
+ *   @brief Pads the current row with zero bits up to the next byte boundary
+ *
+ *   @param buffer output buffer
+ */
+static void kmc_align(struct KmcBuffer *buffer)
+{
+    if (buffer->numberOfBits > 0)
+        kmc_put_bits(buffer, 0, 8 - buffer->numberOfBits);
+}
+
+
+/**
+ *   @brief Returns the length of the exp-Golomb code for a run length
+ *
+ *   @param run run length, at least 1
+ *
+ *   @return number of bits
+ */
+static int kmc_run_bits(unsigned int run)
+{
+    int length = 0;
+    while ((run >> length) > 1)
+        length++;
+    return 2 * length + 1;
+}
+
+
+/**
+ *   @brief Writes a run length as an order-0 exp-Golomb code
+ *
+ *   @param buffer output buffer
+ *   @param run run length, at least 1
+ */
+static void kmc_put_run(struct KmcBuffer *buffer, unsigned int run)
+{
+    int length = kmc_run_bits(run) / 2;
+    kmc_put_bits(buffer, 0, length);
+    kmc_put_bits(buffer, run, length + 1);
+}
+
+
+/**
+ *   @brief Reads count bits, most significant first (zeros past the end of the band)
+ *
+ *   @param reader band reader
+ *   @param count number of bits (at most 32)
+ *
+ *   @return bits that were read
+ */
+static unsigned int kmc_get_bits(struct KmcReader *reader, int count)
+{
+    while (reader->numberOfBits < count)
+    {
+        reader->bits = (reader->bits << 8) | (reader->position < reader->size ? reader->data[reader->position++] : 0);
+        reader->numberOfBits += 8;
+    }
+    reader->numberOfBits -= count;
+    return (reader->bits >> reader->numberOfBits) & ((1ULL << count) - 1);
+}
+
+
+/**
+ *   @brief Reads an order-0 exp-Golomb code
+ *
+ *   @param reader band reader
+ *
+ *   @return run length (0 if the code is invalid)
+ */
+static unsigned int kmc_get_run(struct KmcReader *reader)
+{
+    int length = 0;
+    while (kmc_get_bits(reader, 1) == 0)
+    {
+        if (++length > 31)
+            return 0;
+    }
+    return (1U << length) | (length ? kmc_get_bits(reader, length) : 0);
+}
+
+
+/**
+ *   @brief Returns the number of bits needed for indices below numberOfColors
+ *
+ *   @param numberOfColors number of palette entries
+ *
+ *   @return bits per index (at least 1)
+ */
+static int kmc_index_bits(int numberOfColors)
+{
+    int bits = 1;
+    while ((1 << bits) < numberOfColors)
+        bits++;
+    return bits;
+}
+
+
+/**
+ *   @brief Encodes one row in the smaller of the packed and the run-length form
+ *
+ *   @param buffer output buffer
+ *   @param indices palette indices of the row
+ *   @param indexSize bytes per index in indices (1 or 2)
+ *   @param width number of pixels in the row
+ *   @param bits bits per index
+ */
+static void kmc_encode_row(struct KmcBuffer *buffer, const void *indices, int indexSize, int width, int bits)
+{
+    const unsigned char *indices8 = indices;
+    const unsigned short *indices16 = indices;
+#define KMC_INDEX(x) (indexSize == 1 ? indices8[x] : indices16[x])
+
+    size_t rleBits = 0;
+    for (int x = 0; x < width;)
+    {
+        int end = x + 1;
+        while (end < width && KMC_INDEX(end) == KMC_INDEX(x))
+            end++;
+        rleBits += bits + kmc_run_bits(end - x);
+        x = end;
+    }
+
+    if (rleBits < (size_t)width * bits)
+    {
+        kmc_put_bits(buffer, KMC_ROW_RLE, 8);
+        for (int x = 0; x < width;)
+        {
+            int end = x + 1;
+            while (end < width && KMC_INDEX(end) == KMC_INDEX(x))
+                end++;
+            kmc_put_bits(buffer, KMC_INDEX(x), bits);
+            kmc_put_run(buffer, end - x);
+            x = end;
+        }
+    }
+    else
+    {
+        kmc_put_bits(buffer, KMC_ROW_PACKED, 8);
+        for (int x = 0; x < width; x++)
+            kmc_put_bits(buffer, KMC_INDEX(x), bits);
+    }
+    kmc_align(buffer);
+#undef KMC_INDEX
+}
+
+
+/**
+ *   @brief Stores a 32-bit value in little-endian order
+ *
+ *   @param out destination
+ *   @param value value to store
+ */
+static void kmc_store32(unsigned char *out, unsigned int value)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = value >> (8 * i);
+}
+
+
+/**
+ *   @brief Loads a little-endian 32-bit value
+ *
+ *   @param in source
+ *
+ *   @return loaded value
+ */
+static unsigned int kmc_load32(const unsigned char *in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+
+/**
+ *   @brief Writes a palette and a top-down index map as a KMC file
+ *
+ *   @param fileName output file name
+ *   @param indices top-down map of palette indices
+ *   @param indexSize bytes per index in indices (1 or 2)
+ *   @param palette BGRA palette entries
+ *   @param numberOfColors number of palette entries
+ *   @param width image width
+ *   @param height image height
+ *
+ *   @return 1 if the file was written, 0 otherwise
+ */
+static int kmc_write(const char *fileName, const void *indices, int indexSize, const unsigned char *palette, int numberOfColors, int width, int height)
+{
+    int bits = kmc_index_bits(numberOfColors);
+    int numberOfBands = (height + KMC_ROWS_PER_BAND - 1) / KMC_ROWS_PER_BAND;
+    struct KmcBuffer *bands = calloc(numberOfBands, sizeof(struct KmcBuffer));
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int band = 0; band < numberOfBands; band++)
+    {
+        int lastRow = (band + 1) * KMC_ROWS_PER_BAND < height ? (band + 1) * KMC_ROWS_PER_BAND : height;
+        for (int y = band * KMC_ROWS_PER_BAND; y < lastRow; y++)
+            kmc_encode_row(&bands[band], (const unsigned char *)indices + (size_t)y * width * indexSize, indexSize, width, bits);
+    }
+
+    FILE *file = fopen(fileName, "wb");
+    int written = file != NULL;
+    if (file)
+    {
+        unsigned char header[KMC_HEADER_SIZE] = {'K', 'M', 'C', '1'};
+        kmc_store32(header + 4, width);
+        kmc_store32(header + 8, height);
+        kmc_store32(header + 12, numberOfColors);
+        header[16] = bits;
+        kmc_store32(header + 20, numberOfBands);
+        kmc_store32(header + 24, KMC_ROWS_PER_BAND);
+        written &= fwrite(header, 1, KMC_HEADER_SIZE, file) == KMC_HEADER_SIZE;
+
+        for (int band = 0; band < numberOfBands; band++)
+        {
+            unsigned char size[8];
+            kmc_store32(size, bands[band].size);
+            kmc_store32(size + 4, (unsigned long long)bands[band].size >> 32);
+            written &= fwrite(size, 1, 8, file) == 8;
+        }
+        written &= fwrite(palette, 4, numberOfColors, file) == (size_t)numberOfColors;
+        for (int band = 0; band < numberOfBands; band++)
+            written &= fwrite(bands[band].data, 1, bands[band].size, file) == bands[band].size;
+        written &= fclose(file) == 0;
+    }
+
+    for (int band = 0; band < numberOfBands; band++)
+        free(bands[band].data);
+    free(bands);
+    return written;
+}
+
+
+/**
+ *   @brief Reads the palette and the top-down index map of a KMC file
+ *
+ *   @param fileName input file name
+ *   @param width image width, set on success
+ *   @param height image height, set on success
+ *   @param palette BGRA palette entries (caller frees), set on success
+ *   @param numberOfColors number of palette entries, set on success
+ *
+ *   @return Palette indices (width * height, caller frees) or NULL if the file is missing or invalid
+ */
+static unsigned short *kmc_read_indices(const char *fileName, int *width, int *height, unsigned char **palette, int *numberOfColors)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = malloc(fileSize > 0 ? fileSize : 1);
+    int complete = fileSize >= KMC_HEADER_SIZE && fread(data, 1, fileSize, file) == (size_t)fileSize;
+    fclose(file);
+
+    if (!complete || memcmp(data, "KMC1", 4) != 0)
+    {
+        free(data);
+        return NULL;
+    }
+
+    int imageWidth = kmc_load32(data + 4);
+    int imageHeight = kmc_load32(data + 8);
+    int colors = kmc_load32(data + 12);
+    int bits = data[16];
+    int numberOfBands = kmc_load32(data + 20);
+    int rowsPerBand = kmc_load32(data + 24);
+
+    size_t paletteOffset = KMC_HEADER_SIZE + (size_t)numberOfBands * 8;
+    if (imageWidth <= 0 || imageHeight <= 0 || colors <= 0 || bits < 1 || bits > 16 || rowsPerBand <= 0 ||
+        numberOfBands != (imageHeight + rowsPerBand - 1) / rowsPerBand || paletteOffset + (size_t)colors * 4 > (size_t)fileSize)
+    {
+        free(data);
+        return NULL;
+    }
+
+    // Start of every band from the size table
+    size_t *bandOffsets = malloc((numberOfBands + 1) * sizeof(size_t));
+    bandOffsets[0] = paletteOffset + (size_t)colors * 4;
+    for (int band = 0; band < numberOfBands; band++)
+    {
+        const unsigned char *size = data + KMC_HEADER_SIZE + (size_t)band * 8;
+        bandOffsets[band + 1] = bandOffsets[band] + (kmc_load32(size) | ((unsigned long long)kmc_load32(size + 4) << 32));
+    }
+    if (bandOffsets[numberOfBands] > (size_t)fileSize)
+    {
+        free(bandOffsets);
+        free(data);
+        return NULL;
+    }
+
+    unsigned short *indices = malloc((size_t)imageWidth * imageHeight * sizeof(unsigned short));
+    int valid = 1;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int band = 0; band < numberOfBands; band++)
+    {
+        struct KmcReader reader = {data + bandOffsets[band], bandOffsets[band + 1] - bandOffsets[band], 0, 0, 0};
+        int lastRow = (band + 1) * rowsPerBand < imageHeight ? (band + 1) * rowsPerBand : imageHeight;
+
+        for (int y = band * rowsPerBand; y < lastRow; y++)
+        {
+            unsigned short *row = indices + (size_t)y * imageWidth;
+            int mode = kmc_get_bits(&reader, 8);
+
+            for (int x = 0; x < imageWidth;)
+            {
+                unsigned int index = kmc_get_bits(&reader, bits);
+                unsigned int run = mode == KMC_ROW_RLE ? kmc_get_run(&reader) : 1;
+                if (index >= (unsigned int)colors || run == 0 || run > (unsigned int)(imageWidth - x))
+                {
+                    #ifdef _OPENMP
+                    #pragma omp atomic write
+                    #endif
+                    valid = 0;
+                    break;
+                }
+                for (; run > 0; run--, x++)
+                    row[x] = index;
+            }
+
+            // Rows start on byte boundaries
+            reader.numberOfBits = 0;
+        }
+    }
+
+    free(bandOffsets);
+    if (!valid)
+    {
+        free(indices);
+        free(data);
+        return NULL;
+    }
+
+    *palette = malloc((size_t)colors * 4);
+    memcpy(*palette, data + paletteOffset, (size_t)colors * 4);
+    free(data);
+    *numberOfColors = colors;
+    *width = imageWidth;
+    *height = imageHeight;
+    return indices;
+}
+
+
+/**
+ *   @brief Reads a KMC file and expands it into top-down raw BGRA data
+ *
+ *   @param fileName input file name
+ *   @param width image width, set on success
+ *   @param height image height, set on success
+ *
+ *   @return Image data (width * height * 4 bytes, caller frees) or NULL if the file is missing or invalid
+ */
+static unsigned char *kmc_read(const char *fileName, int *width, int *height)
+{
+    unsigned char *palette;
+    int numberOfColors;
+    unsigned short *indices = kmc_read_indices(fileName, width, height, &palette, &numberOfColors);
+    if (indices == NULL)
+        return NULL;
+
+    size_t numberOfPixels = (size_t)*width * *height;
+    unsigned char *image = malloc(numberOfPixels * 4);
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (size_t i = 0; i < numberOfPixels; i++)
+        memcpy(image + i * 4, palette + indices[i] * 4, 4);
+
+    free(indices);
+    free(palette);
+    return image;
+}
+
+
+/**
+ *   @brief Reads a written KMC file back and compares it with the data it was encoded from
+ *
+ *   @param fileName KMC file name
+ *   @param indices top-down map of palette indices that was encoded
+ *   @param indexSize bytes per index in indices (1 or 2)
+ *   @param palette BGRA palette entries that were encoded
+ *   @param numberOfColors number of palette entries
+ *   @param width image width
+ *   @param height image height
+ *
+ *   @return 1 if the decoded palette and indices are identical, 0 otherwise
+ */
+static inline int kmc_verify(const char *fileName, const void *indices, int indexSize, const unsigned char *palette, int numberOfColors, int width, int height)
+{
+    int decodedWidth, decodedHeight, decodedColors;
+    unsigned char *decodedPalette;
+    unsigned short *decoded = kmc_read_indices(fileName, &decodedWidth, &decodedHeight, &decodedPalette, &decodedColors);
+    if (decoded == NULL)
+        return 0;
+
+    int same = decodedWidth == width && decodedHeight == height && decodedColors == numberOfColors &&
+               memcmp(decodedPalette, palette, (size_t)numberOfColors * 4) == 0;
+    for (size_t i = 0; same && i < (size_t)width * height; i++)
+        same = decoded[i] == (indexSize == 1 ? ((const unsigned char *)indices)[i] : ((const unsigned short *)indices)[i]);
+
+    free(decoded);
+    free(decodedPalette);
+    return same;
+}
+
+
+/**
+ *   @brief Checks whether a file name has the .kmc extension
+ *
+ *   @param fileName file name
+ *
+ *   @return 1 for KMC files, 0 otherwise
+ */
+static int kmc_is_kmc(const char *fileName)
+{
+    size_t length = strlen(fileName);
+    return length >= 4 && strcmp(fileName + length - 4, ".kmc") == 0;
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef PALETTE_CACHE_H
+#define PALETTE_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "kmc.h"
+
+/*
+ * On-disk cache of trained palettes keyed by a colour histogram signature (--cache in the CPU programs).
+ *
+ * The signature is a coarse histogram with 4 bits per colour channel (alpha left out), every bin holding its
+ * share of the pixels in units of 1/PALETTE_CACHE_SCALE. Entries are named after k and a 64-bit FNV-1a hash
+ * of the signature ("k<k>-<hash>.kpc"), so an identical signature is found by name. Otherwise every entry
+ * with the same k is compared by the L1 distance of the signatures (0 to 2), and the closest one within the
+ * threshold is a near hit. Entries are written to a temporary file and renamed into place, so concurrent
+ * processes only ever see complete files. Every lookup appends one byte (H, N or M) to the "stats" file with
+ * O_APPEND, which gives hit/miss counters over all processes sharing the directory.
+ *
+ * Entry layout (little-endian): "KPC1", u32 numberOfColors, u32 PALETTE_CACHE_BINS,
+ * u16 signature[PALETTE_CACHE_BINS], palette (B, G, R, A per entry).
+ */
+
+#define PALETTE_CACHE_BINS 4096
+#define PALETTE_CACHE_SCALE 16384
+#define PALETTE_CACHE_HEADER_SIZE 12
+
+enum CacheResult { CACHE_MISS, CACHE_NEAR, CACHE_HIT };
+
+
+/**
+ *   @brief Computes the coarse colour histogram signature of an image
+ *
+ *   @param image raw image data, 4 bytes per sample
+ *   @param numberOfSamples number of samples
+ *   @param signature share of every bin in units of 1 / PALETTE_CACHE_SCALE, set on return
+ */
+static void palette_cache_signature(const unsigned char *image, size_t numberOfSamples, unsigned short *signature)
+{
+    long long *histogram = calloc(PALETTE_CACHE_BINS, sizeof(long long));
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        long long *local = calloc(PALETTE_CACHE_BINS, sizeof(long long));
+        #ifdef _OPENMP
+        #pragma omp for schedule(static)
+        #endif
+        for (size_t i = 0; i < numberOfSamples; i++)
+            local[((image[i * 4 + 2] >> 4) << 8) | ((image[i * 4 + 1] >> 4) << 4) | (image[i * 4 + 0] >> 4)]++;
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+            histogram[bin] += local[bin];
+        free(local);
+    }
+
+    for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+        signature[bin] = numberOfSamples > 0 ? (histogram[bin] * PALETTE_CACHE_SCALE + numberOfSamples / 2) / numberOfSamples : 0;
+    free(histogram);
+}
+
+
+/**
+ *   @brief Builds the entry name of a signature
+ *
+ *   @param directory cache directory
+ *   @param signature colour histogram signature
+ *   @param numberOfColors number of palette entries
+ *   @param fileName entry path, set on return
+ *   @param size size of fileName
+ */
+static void palette_cache_name(const char *directory, const unsigned short *signature, int numberOfColors, char *fileName, size_t size)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+    {
+        hash = (hash ^ (signature[bin] & 0xff)) * 1099511628211ULL;
+        hash = (hash ^ (signature[bin] >> 8)) * 1099511628211ULL;
+    }
+    snprintf(fileName, size, "%s/k%d-%016llx.kpc", directory, numberOfColors, hash);
+}
+
+
+/**
+ *   @brief Reads a cache entry
+ *
+ *   @param fileName entry path
+ *   @param numberOfColors expected number of palette entries
+ *   @param signature signature of the entry, set on success
+ *   @param palette BGRA palette entries, set on success if not NULL
+ *
+ *   @return 1 if a complete entry with numberOfColors entries was read, 0 otherwise
+ */
+static int palette_cache_read(const char *fileName, int numberOfColors, unsigned short *signature, unsigned char *palette)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+        return 0;
+
+    unsigned char header[PALETTE_CACHE_HEADER_SIZE];
+    unsigned char *bins = malloc(PALETTE_CACHE_BINS * 2);
+    int complete = fread(header, 1, PALETTE_CACHE_HEADER_SIZE, file) == PALETTE_CACHE_HEADER_SIZE && memcmp(header, "KPC1", 4) == 0 &&
+                   (int)kmc_load32(header + 4) == numberOfColors && kmc_load32(header + 8) == PALETTE_CACHE_BINS &&
+                   fread(bins, 2, PALETTE_CACHE_BINS, file) == PALETTE_CACHE_BINS;
+    if (complete)
+    {
+        for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+            signature[bin] = bins[bin * 2] | (bins[bin * 2 + 1] << 8);
+        if (palette != NULL)
+            complete = fread(palette, 4, numberOfColors, file) == (size_t)numberOfColors;
+    }
+
+    free(bins);
+    fclose(file);
+    return complete;
+}
+
+
+/**
+ *   @brief Appends one lookup result to the shared counters of the cache directory
+ *
+ *   @param directory cache directory
+ *   @param result lookup result
+ */
+static void palette_cache_count(const char *directory, enum CacheResult result)
+{
+    char fileName[4096];
+    snprintf(fileName, sizeof(fileName), "%s/stats", directory);
+    int file = open(fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (file < 0)
+        return;
+    char record = result == CACHE_HIT ? 'H' : result == CACHE_NEAR ? 'N' : 'M';
+    if (write(file, &record, 1) != 1)
+        fprintf(stderr, "Could not update '%s'.\n", fileName);
+    close(file);
+}
+
+
+/**
+ *   @brief Reads the shared counters of the cache directory
+ *
+ *   @param directory cache directory
+ *   @param counters number of hits, near hits and misses (indexed by CacheResult), set on return
+ */
+static void palette_cache_counters(const char *directory, long long *counters)
+{
+    char fileName[4096];
+    snprintf(fileName, sizeof(fileName), "%s/stats", directory);
+    counters[CACHE_MISS] = counters[CACHE_NEAR] = counters[CACHE_HIT] = 0;
+
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+        return;
+    int record;
+    while ((record = fgetc(file)) != EOF)
+        counters[record == 'H' ? CACHE_HIT : record == 'N' ? CACHE_NEAR : CACHE_MISS]++;
+    fclose(file);
+}
+
+
+/**
+ *   @brief Looks up the palette of an image
+ *
+ *   @param directory cache directory (created if missing)
+ *   @param signature colour histogram signature of the image
+ *   @param numberOfColors number of palette entries
+ *   @param maxDistance largest L1 distance of a near hit (0 to 2)
+ *   @param palette BGRA palette entries of the hit, set unless the result is CACHE_MISS
+ *   @param distance L1 distance of the hit, set unless the result is CACHE_MISS
+ *
+ *   @return CACHE_HIT for an identical signature, CACHE_NEAR for one within maxDistance, CACHE_MISS otherwise
+ */
+static enum CacheResult palette_cache_lookup(const char *directory, const unsigned short *signature, int numberOfColors, double maxDistance,
+                                            unsigned char *palette, double *distance)
+{
+    char fileName[4096];
+    unsigned short *entry = malloc(PALETTE_CACHE_BINS * sizeof(unsigned short));
+    enum CacheResult result = CACHE_MISS;
+    mkdir(directory, 0755);
+
+    // Identical signature: the entry is found by name
+    palette_cache_name(directory, signature, numberOfColors, fileName, sizeof(fileName));
+    if (palette_cache_read(fileName, numberOfColors, entry, palette) && memcmp(entry, signature, PALETTE_CACHE_BINS * sizeof(unsigned short)) == 0)
+    {
+        *distance = 0;
+        result = CACHE_HIT;
+    }
+
+    // Otherwise the closest entry with the same k
+    DIR *dir = result == CACHE_MISS ? opendir(directory) : NULL;
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "k%d-", numberOfColors);
+    long long bestDistance = (long long)(maxDistance * PALETTE_CACHE_SCALE);
+    char bestName[4096] = "";
+    struct dirent *item;
+    while (dir != NULL && (item = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(item->d_name);
+        if (strncmp(item->d_name, prefix, strlen(prefix)) != 0 || length < 4 || strcmp(item->d_name + length - 4, ".kpc") != 0)
+            continue;
+        snprintf(fileName, sizeof(fileName), "%s/%s", directory, item->d_name);
+        if (!palette_cache_read(fileName, numberOfColors, entry, NULL))
+            continue;
+
+        long long l1 = 0;
+        for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+            l1 += abs((int)entry[bin] - (int)signature[bin]);
+        if (l1 <= bestDistance)
+        {
+            bestDistance = l1;
+            snprintf(bestName, sizeof(bestName), "%s", fileName);
+        }
+    }
+    if (dir != NULL)
+        closedir(dir);
+    if (bestName[0] != '\0' && palette_cache_read(bestName, numberOfColors, entry, palette))
+    {
+        *distance = (double)bestDistance / PALETTE_CACHE_SCALE;
+        result = CACHE_NEAR;
+    }
+
+    free(entry);
+    palette_cache_count(directory, result);
+    return result;
+}
+
+
+/**
+ *   @brief Stores the trained palette of an image
+ *
+ *   The entry is written to a temporary file and renamed into place, which is atomic, so concurrent
+ *   readers and writers never see a partial entry; the last writer of the same signature wins.
+ *
+ *   @param directory cache directory (created if missing)
+ *   @param signature colour histogram signature of the image
+ *   @param palette BGRA palette entries
+ *   @param numberOfColors number of palette entries
+ *
+ *   @return 1 if the entry was stored, 0 otherwise
+ */
+static int palette_cache_store(const char *directory, const unsigned short *signature, const unsigned char *palette, int numberOfColors)
+{
+    char fileName[4096], temporaryName[4096];
+    mkdir(directory, 0755);
+    palette_cache_name(directory, signature, numberOfColors, fileName, sizeof(fileName));
+    snprintf(temporaryName, sizeof(temporaryName), "%s/.tmp-%d-%d", directory, (int)getpid(), rand());
+
+    FILE *file = fopen(temporaryName, "wb");
+    if (!file)
+        return 0;
+
+    unsigned char header[PALETTE_CACHE_HEADER_SIZE] = {'K', 'P', 'C', '1'};
+    kmc_store32(header + 4, numberOfColors);
+    kmc_store32(header + 8, PALETTE_CACHE_BINS);
+    unsigned char *bins = malloc(PALETTE_CACHE_BINS * 2);
+    for (int bin = 0; bin < PALETTE_CACHE_BINS; bin++)
+    {
+        bins[bin * 2] = signature[bin] & 0xff;
+        bins[bin * 2 + 1] = signature[bin] >> 8;
+    }
+
+    int written = fwrite(header, 1, PALETTE_CACHE_HEADER_SIZE, file) == PALETTE_CACHE_HEADER_SIZE;
+    written &= fwrite(bins, 2, PALETTE_CACHE_BINS, file) == PALETTE_CACHE_BINS;
+    written &= fwrite(palette, 4, numberOfColors, file) == (size_t)numberOfColors;
+    written &= fclose(file) == 0;
+    free(bins);
+
+    if (!written || rename(temporaryName, fileName) != 0)
+    {
+        remove(temporaryName);
+        return 0;
+    }
+    return 1;
+}
+
+#endif
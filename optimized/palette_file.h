@@ -0,0 +1,183 @@
+#ifndef PALETTE_FILE_H
+#define PALETTE_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kmc.h"
+
+/*
+ * Saved palettes (--save-palette / --palette in the CPU programs).
+ *
+ * Names ending in .json are written as JSON:
+ *   {"colors": k, "width": w, "height": h, "iterations": n, "inertia": i, "psnr": p,
+ *    "centroids": [[r, g, b, a], ...]}
+ * anything else in the binary layout (little-endian):
+ *   "KMP1", u32 numberOfColors, u32 width, u32 height, u32 iterations, u64 inertia,
+ *   palette (B, G, R, A per entry, as in KMC files).
+ * The statistics describe the image the palette was trained on; loading only needs the centroids and
+ * detects the format from the contents.
+ */
+
+#define PALETTE_FILE_HEADER_SIZE 28
+
+
+/**
+ *   @brief Checks whether a file name has the .json extension
+ *
+ *   @param fileName file name
+ *
+ *   @return 1 for JSON palette files, 0 otherwise
+ */
+static int palette_file_is_json(const char *fileName)
+{
+    size_t length = strlen(fileName);
+    return length >= 5 && strcmp(fileName + length - 5, ".json") == 0;
+}
+
+
+/**
+ *   @brief Writes a palette with the statistics of the run that produced it
+ *
+ *   @param fileName output file name, JSON if it ends in .json
+ *   @param palette BGRA palette entries
+ *   @param numberOfColors number of palette entries
+ *   @param width width of the training image
+ *   @param height height of the training image
+ *   @param numberOfIterations number of k-means iterations
+ *   @param inertia sum of squared distances of the final assignment
+ *
+ *   @return 1 if the file was written, 0 otherwise
+ */
+static int palette_save(const char *fileName, const unsigned char *palette, int numberOfColors, int width, int height, int numberOfIterations, long long inertia)
+{
+    FILE *file = fopen(fileName, "wb");
+    if (!file)
+        return 0;
+
+    int written = 1;
+    if (palette_file_is_json(fileName))
+    {
+        double psnr = 10.0 * log10(255.0 * 255.0 * 3.0 * width * height / (inertia > 0 ? inertia : 1));
+        written &= fprintf(file, "{\n  \"colors\": %d,\n  \"width\": %d,\n  \"height\": %d,\n  \"iterations\": %d,\n  \"inertia\": %lld,\n  \"psnr\": %.2f,\n  \"centroids\": [",
+                           numberOfColors, width, height, numberOfIterations, inertia, psnr) > 0;
+        for (int k = 0; k < numberOfColors; k++)
+            written &= fprintf(file, "%s\n    [%d, %d, %d, %d]", k > 0 ? "," : "", palette[k * 4 + 2], palette[k * 4 + 1], palette[k * 4 + 0], palette[k * 4 + 3]) > 0;
+        written &= fprintf(file, "\n  ]\n}\n") > 0;
+    }
+    else
+    {
+        unsigned char header[PALETTE_FILE_HEADER_SIZE] = {'K', 'M', 'P', '1'};
+        kmc_store32(header + 4, numberOfColors);
+        kmc_store32(header + 8, width);
+        kmc_store32(header + 12, height);
+        kmc_store32(header + 16, numberOfIterations);
+        kmc_store32(header + 20, inertia);
+        kmc_store32(header + 24, (unsigned long long)inertia >> 32);
+        written &= fwrite(header, 1, PALETTE_FILE_HEADER_SIZE, file) == PALETTE_FILE_HEADER_SIZE;
+        written &= fwrite(palette, 4, numberOfColors, file) == (size_t)numberOfColors;
+    }
+    written &= fclose(file) == 0;
+    return written;
+}
+
+
+/**
+ *   @brief Reads the centroids of a palette written by palette_save
+ *
+ *   @param fileName palette file, binary or JSON
+ *   @param numberOfColors number of palette entries, set on return
+ *
+ *   @return BGRA palette entries (free with free) or NULL if the file cannot be read or holds a value that is not
+ *           an integer in 0-255
+ */
+static unsigned char *palette_load(const char *fileName, int *numberOfColors)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = malloc(fileSize > 0 ? fileSize + 1 : 1);
+    int complete = fileSize > 0 && fread(data, 1, fileSize, file) == (size_t)fileSize;
+    fclose(file);
+    data[complete ? fileSize : 0] = '\0';
+
+    unsigned char *palette = NULL;
+    int count = 0;
+    if (complete && fileSize >= PALETTE_FILE_HEADER_SIZE && memcmp(data, "KMP1", 4) == 0)
+    {
+        count = kmc_load32((unsigned char *)data + 4);
+        if (count > 0 && PALETTE_FILE_HEADER_SIZE + (size_t)count * 4 <= (size_t)fileSize)
+        {
+            palette = malloc((size_t)count * 4);
+            memcpy(palette, data + PALETTE_FILE_HEADER_SIZE, (size_t)count * 4);
+        }
+    }
+    else if (complete)
+    {
+        // Every group of four numbers inside the "centroids" array is one R, G, B, A entry
+        char *position = strstr(data, "\"centroids\"");
+        position = position != NULL ? strchr(position, '[') : NULL;
+        int capacity = 0, channel = 0, depth = 0, invalid = 0;
+        unsigned char entry[4];
+        while (position != NULL && *position != '\0')
+        {
+            if (*position == '[')
+            {
+                depth++;
+                position++;
+            }
+            else if (*position == ']')
+            {
+                if (--depth == 0)
+                    break;
+                position++;
+            }
+            else if (*position == '-' || (*position >= '0' && *position <= '9'))
+            {
+                // A lone '-' parses nothing and would not advance position
+                char *end;
+                long value = strtol(position, &end, 10);
+                if (end == position || value < 0 || value > 255)
+                {
+                    invalid = 1;
+                    break;
+                }
+                position = end;
+                entry[channel++] = value;
+                if (channel == 4)
+                {
+                    if (count == capacity)
+                    {
+                        capacity = capacity ? 2 * capacity : 256;
+                        palette = realloc(palette, (size_t)capacity * 4);
+                    }
+                    palette[count * 4 + 0] = entry[2];
+                    palette[count * 4 + 1] = entry[1];
+                    palette[count * 4 + 2] = entry[0];
+                    palette[count * 4 + 3] = entry[3];
+                    count++;
+                    channel = 0;
+                }
+            }
+            else
+            {
+                position++;
+            }
+        }
+        if (invalid || depth != 0 || channel != 0 || count == 0)
+        {
+            free(palette);
+            palette = NULL;
+        }
+    }
+
+    free(data);
+    *numberOfColors = palette != NULL ? count : 0;
+    return palette;
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef PALETTE_LUT_H
+#define PALETTE_LUT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Colour-to-centroid lookup table (--assign lut in the CPU programs).
+ *
+ * Once the centroids are fixed, the nearest one is a pure function of the colour. The colour cube is split
+ * into PALETTE_LUT_SIZE^3 cells of 8x8x8 values and every cell keeps the list of centroids that can be the
+ * nearest one to some colour inside it: a centroid whose distance to the cell box is larger than the
+ * smallest farthest-corner distance of any centroid never can. A lookup scans only the candidates of the
+ * sample's cell, in increasing index order, so the result is exact and ties go to the lowest index. Cells
+ * choose from the candidates of their block of PALETTE_LUT_BLOCK^3 cells, which keeps the build cheap. The
+ * table is built for one alpha value (that of the first sample, 255 for opaque images); samples with a
+ * different alpha fall back to the full scan. Blocks are independent and built in parallel with OpenMP.
+ */
+
+#define PALETTE_LUT_SIZE 32
+#define PALETTE_LUT_SHIFT 3
+#define PALETTE_LUT_BLOCK 4
+#define PALETTE_LUT_CELLS (PALETTE_LUT_SIZE * PALETTE_LUT_SIZE * PALETTE_LUT_SIZE)
+
+struct PaletteLut
+{
+    const unsigned char *centroids;
+    int numberOfClusters;
+    unsigned char alpha;            // Alpha value the table was built for
+    int *offsets;                   // Candidates of cell i are candidates[offsets[i] .. offsets[i + 1])
+    int *candidates;                // Centroid indices in increasing order
+    int capacity;                   // Allocated length of candidates
+};
+
+
+/**
+ *   @brief Returns the cell of a sample
+ *
+ *   @param sample 4-byte sample
+ *
+ *   @return cell index
+ */
+static int palette_lut_cell(const unsigned char *sample)
+{
+    return ((sample[0] >> PALETTE_LUT_SHIFT) * PALETTE_LUT_SIZE + (sample[1] >> PALETTE_LUT_SHIFT)) * PALETTE_LUT_SIZE + (sample[2] >> PALETTE_LUT_SHIFT);
+}
+
+
+/**
+ *   @brief Finds the centroids that can be the nearest one to some colour in a box
+ *
+ *   @param lut table being built
+ *   @param low lowest colour of the box (first three channels)
+ *   @param size edge length of the box
+ *   @param from centroid indices to choose from in increasing order, NULL for all of them
+ *   @param count number of centroids in from
+ *   @param candidates candidate indices in increasing order, set on return if not NULL
+ *
+ *   @return number of candidates
+ */
+static int palette_lut_box(const struct PaletteLut *lut, const int *low, int size, const int *from, int count, int *candidates)
+{
+    int high[3] = {low[0] + size - 1, low[1] + size - 1, low[2] + size - 1};
+
+    // Smallest distance to the farthest corner of the box, no colour in the box is farther from its nearest centroid
+    int bound = INT_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned char *centroid = lut->centroids + (from != NULL ? from[i] : i) * 4;
+        int distance = (lut->alpha - centroid[3]) * (lut->alpha - centroid[3]);
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int d = centroid[channel] - low[channel] > high[channel] - centroid[channel] ? centroid[channel] - low[channel] : high[channel] - centroid[channel];
+            distance += d * d;
+        }
+        bound = distance < bound ? distance : bound;
+    }
+
+    int numberOfCandidates = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned char *centroid = lut->centroids + (from != NULL ? from[i] : i) * 4;
+        int distance = (lut->alpha - centroid[3]) * (lut->alpha - centroid[3]);
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int d = centroid[channel] < low[channel] ? low[channel] - centroid[channel] :
+                    centroid[channel] > high[channel] ? centroid[channel] - high[channel] : 0;
+            distance += d * d;
+        }
+        if (distance <= bound)
+        {
+            if (candidates != NULL)
+                candidates[numberOfCandidates] = from != NULL ? from[i] : i;
+            numberOfCandidates++;
+        }
+    }
+    return numberOfCandidates;
+}
+
+
+/**
+ *   @brief Finds the candidates of every cell in one block of PALETTE_LUT_BLOCK^3 cells
+ *
+ *   The candidates of a cell are a subset of those of its block (the block's bound is not smaller and its
+ *   box distances are not larger), so cells only choose from the block's list.
+ *
+ *   @param lut table being built
+ *   @param block block index
+ *   @param blockCandidates scratch space for numberOfClusters indices
+ *   @param write 0 to store the candidate counts in offsets[cell + 1], 1 to fill the lists at offsets[cell]
+ */
+static void palette_lut_block(struct PaletteLut *lut, int block, int *blockCandidates, int write)
+{
+    int blocksPerSide = PALETTE_LUT_SIZE / PALETTE_LUT_BLOCK;
+    int cellSize = 1 << PALETTE_LUT_SHIFT;
+    int first[3] = {block / (blocksPerSide * blocksPerSide) * PALETTE_LUT_BLOCK, block / blocksPerSide % blocksPerSide * PALETTE_LUT_BLOCK,
+                    block % blocksPerSide * PALETTE_LUT_BLOCK};
+    int low[3] = {first[0] * cellSize, first[1] * cellSize, first[2] * cellSize};
+    int numberOfBlockCandidates = palette_lut_box(lut, low, PALETTE_LUT_BLOCK * cellSize, NULL, lut->numberOfClusters, blockCandidates);
+
+    for (int x = first[0]; x < first[0] + PALETTE_LUT_BLOCK; x++)
+        for (int y = first[1]; y < first[1] + PALETTE_LUT_BLOCK; y++)
+            for (int z = first[2]; z < first[2] + PALETTE_LUT_BLOCK; z++)
+            {
+                int cell = (x * PALETTE_LUT_SIZE + y) * PALETTE_LUT_SIZE + z;
+                int cellLow[3] = {x * cellSize, y * cellSize, z * cellSize};
+                if (write)
+                    palette_lut_box(lut, cellLow, cellSize, blockCandidates, numberOfBlockCandidates, lut->candidates + lut->offsets[cell]);
+                else
+                    lut->offsets[cell + 1] = palette_lut_box(lut, cellLow, cellSize, blockCandidates, numberOfBlockCandidates, NULL);
+            }
+}
+
+
+/**
+ *   @brief Builds (or rebuilds after a centroid update) the table
+ *
+ *   @param lut table, zero-initialized before the first call
+ *   @param centroids centroids, 4 bytes each
+ *   @param numberOfClusters number of centroids
+ *   @param alpha alpha value of the samples the table serves
+ */
+static void palette_lut_build(struct PaletteLut *lut, const unsigned char *centroids, int numberOfClusters, unsigned char alpha)
+{
+    int numberOfBlocks = PALETTE_LUT_CELLS / (PALETTE_LUT_BLOCK * PALETTE_LUT_BLOCK * PALETTE_LUT_BLOCK);
+
+    if (lut->offsets == NULL)
+        lut->offsets = malloc((PALETTE_LUT_CELLS + 1) * sizeof(int));
+    lut->centroids = centroids;
+    lut->numberOfClusters = numberOfClusters;
+    lut->alpha = alpha;
+
+    // Count the candidates of every cell, then fill the lists at their prefix-sum offsets
+    for (int write = 0; write < 2; write++)
+    {
+        if (write)
+        {
+            lut->offsets[0] = 0;
+            for (int cell = 0; cell < PALETTE_LUT_CELLS; cell++)
+                lut->offsets[cell + 1] += lut->offsets[cell];
+            if (lut->offsets[PALETTE_LUT_CELLS] > lut->capacity)
+            {
+                free(lut->candidates);
+                lut->capacity = lut->offsets[PALETTE_LUT_CELLS];
+                lut->candidates = malloc(lut->capacity * sizeof(int));
+            }
+        }
+
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            int *blockCandidates = malloc(numberOfClusters * sizeof(int));
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+            #endif
+            for (int block = 0; block < numberOfBlocks; block++)
+                palette_lut_block(lut, block, blockCandidates, write);
+            free(blockCandidates);
+        }
+    }
+}
+
+
+/**
+ *   @brief Frees the table
+ *
+ *   @param lut table built with palette_lut_build
+ */
+static void palette_lut_free(struct PaletteLut *lut)
+{
+    free(lut->offsets);
+    free(lut->candidates);
+    memset(lut, 0, sizeof(*lut));
+}
+
+
+/**
+ *   @brief Returns the exact nearest centroid of a sample (lowest index on ties)
+ *
+ *   @param lut lookup table
+ *   @param sample 4-byte sample
+ *   @param deviation squared distance to the nearest centroid, set on return
+ *   @param evaluations number of distance evaluations, incremented
+ *
+ *   @return index of the nearest centroid
+ */
+static int palette_lut_nearest(const struct PaletteLut *lut, const unsigned char *sample, int *deviation, long long *evaluations)
+{
+    int cell = palette_lut_cell(sample);
+    int first = lut->offsets[cell], last = lut->offsets[cell + 1];
+
+    // Samples with another alpha are not covered by the table
+    if (sample[3] != lut->alpha)
+    {
+        first = 0;
+        last = lut->numberOfClusters;
+    }
+
+    int best = INT_MAX;
+    int bestIndex = 0;
+    for (int i = first; i < last; i++)
+    {
+        int k = sample[3] != lut->alpha ? i : lut->candidates[i];
+        const unsigned char *centroid = lut->centroids + k * 4;
+        int d = (sample[0] - centroid[0]) * (sample[0] - centroid[0]) + (sample[1] - centroid[1]) * (sample[1] - centroid[1]) +
+                (sample[2] - centroid[2]) * (sample[2] - centroid[2]) + (sample[3] - centroid[3]) * (sample[3] - centroid[3]);
+        if (d < best)
+        {
+            best = d;
+            bestIndex = k;
+        }
+    }
+    *evaluations += last - first;
+
+    *deviation = best;
+    return bestIndex;
+}
+
+#endif
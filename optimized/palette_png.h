@@ -0,0 +1,476 @@
+#ifndef PALETTE_PNG_H
+#define PALETTE_PNG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "FreeImage.h"
+
+/*
+ * Output helpers shared by CPU_Sequential.c, CPU_OpenMP.c and GPU_OpenCL.c.
+ *
+ * Palettes use the byte order of the raw image data (B, G, R, A per entry), so the CPU centroid
+ * arrays can be passed as they are.
+ *
+ * save_png_parallel is an alternative to FreeImage_Save for large outputs: bands of rows are filtered
+ * and deflated in parallel (OpenMP), every band but the last ends with a sync flush, so the raw deflate
+ * streams concatenate into one zlib stream; the Adler-32 checksums are joined with adler32_combine.
+ */
+
+#define PNG_BAND_ROWS 64
+
+// Background save started with png_save_async
+struct PngJob
+{
+    const char *fileName;
+    const unsigned char *data;
+    int width, height, pitch;
+    const unsigned char *palette;
+    int numberOfColors, level;
+    int saved, started;
+    pthread_t thread;
+};
+
+
+/**
+ *   @brief Saves an 8-bit PNG with the given palette; alpha goes into a tRNS chunk if any entry is not opaque
+ *
+ *   @param fileName output file name
+ *   @param indices top-down map of 8-bit palette indices
+ *   @param palette BGRA palette entries
+ *   @param numberOfColors number of palette entries (at most 256)
+ *   @param width image width
+ *   @param height image height
+ *
+ *   @return 1 if the image was saved, 0 otherwise
+ */
+static int save_palette_png(const char *fileName, const unsigned char *indices, const unsigned char *palette, int numberOfColors, int width, int height)
+{
+    FIBITMAP *bitmap = FreeImage_Allocate(width, height, 8, 0, 0, 0);
+    RGBQUAD *bitmapPalette = FreeImage_GetPalette(bitmap);
+    BYTE alpha[256];
+    int transparent = 0;
+
+    for (int k = 0; k < numberOfColors; k++)
+    {
+        bitmapPalette[k].rgbBlue = palette[k * 4 + 0];
+        bitmapPalette[k].rgbGreen = palette[k * 4 + 1];
+        bitmapPalette[k].rgbRed = palette[k * 4 + 2];
+        bitmapPalette[k].rgbReserved = 0;
+        alpha[k] = palette[k * 4 + 3];
+        transparent |= alpha[k] != 255;
+    }
+    if (transparent)
+        FreeImage_SetTransparencyTable(bitmap, alpha, numberOfColors);
+
+    // FreeImage stores scanlines bottom-up
+    for (int y = 0; y < height; y++)
+        memcpy(FreeImage_GetScanLine(bitmap, height - 1 - y), indices + (size_t)y * width, width);
+
+    int saved = FreeImage_Save(FIF_PNG, bitmap, fileName, 0);
+    FreeImage_Unload(bitmap);
+    return saved;
+}
+
+
+/**
+ *   @brief Saves top-down raw BGRA data as a 32-bit PNG
+ *
+ *   @param fileName output file name
+ *   @param image raw image data
+ *   @param width image width
+ *   @param height image height
+ *   @param pitch bytes per row
+ *
+ *   @return 1 if the image was saved, 0 otherwise
+ */
+static int save_rgba_png(const char *fileName, unsigned char *image, int width, int height, int pitch)
+{
+    FIBITMAP *bitmap = FreeImage_ConvertFromRawBits(image, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+    int saved = FreeImage_Save(FIF_PNG, bitmap, fileName, 0);
+    FreeImage_Unload(bitmap);
+    return saved;
+}
+
+
+/**
+ *   @brief Stores a 32-bit value in big-endian order, as used by PNG
+ *
+ *   @param out destination
+ *   @param value value to store
+ */
+static void png_store32(unsigned char *out, unsigned long value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+
+/**
+ *   @brief Writes one PNG chunk with its length and CRC
+ *
+ *   @param file output file
+ *   @param type four letter chunk type
+ *   @param data chunk data
+ *   @param length length of the data
+ *
+ *   @return 1 on success, 0 otherwise
+ */
+static int png_write_chunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char header[8], footer[4];
+    png_store32(header, length);
+    memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0L, (const Bytef *)type, 4);
+    for (size_t offset = 0; offset < length; offset += 1 << 30)
+        crc = crc32(crc, data + offset, length - offset < (1 << 30) ? length - offset : 1 << 30);
+    png_store32(footer, crc);
+
+    return fwrite(header, 1, 8, file) == 8 && (length == 0 || fwrite(data, 1, length, file) == length) && fwrite(footer, 1, 4, file) == 4;
+}
+
+
+/**
+ *   @brief Predictor used by the Paeth filter
+ *
+ *   @param a left byte
+ *   @param b byte above
+ *   @param c byte above left
+ *
+ *   @return the neighbour closest to a + b - c
+ */
+static int png_paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+
+/**
+ *   @brief Filters one row with the filter that gives the smallest sum of absolute differences
+ *
+ *   @param out filter type byte followed by the filtered row
+ *   @param row unfiltered row
+ *   @param previous unfiltered row above (all zeros for the first row)
+ *   @param length bytes in the row
+ *   @param bytesPerPixel distance to the left neighbour
+ *   @param candidate scratch buffer of length bytes
+ */
+static void png_filter_row(unsigned char *out, const unsigned char *row, const unsigned char *previous, size_t length, int bytesPerPixel,
+                           unsigned char *candidate)
+{
+    unsigned long bestSum = (unsigned long)-1;
+
+    for (int filter = 0; filter < 5; filter++)
+    {
+        // The first pixel has no left neighbour (a = c = 0)
+        for (size_t i = 0; i < (size_t)bytesPerPixel && i < length; i++)
+        {
+            int b = previous[i];
+            int predicted = filter == 0 || filter == 1 ? 0 : filter == 3 ? b / 2 : b;
+            candidate[i] = row[i] - predicted;
+        }
+        switch (filter)
+        {
+        case 0:
+            memcpy(candidate, row, length);
+            break;
+        case 1:
+            for (size_t i = bytesPerPixel; i < length; i++)
+                candidate[i] = row[i] - row[i - bytesPerPixel];
+            break;
+        case 2:
+            for (size_t i = bytesPerPixel; i < length; i++)
+                candidate[i] = row[i] - previous[i];
+            break;
+        case 3:
+            for (size_t i = bytesPerPixel; i < length; i++)
+                candidate[i] = row[i] - ((row[i - bytesPerPixel] + previous[i]) >> 1);
+            break;
+        default:
+            for (size_t i = bytesPerPixel; i < length; i++)
+                candidate[i] = row[i] - png_paeth(row[i - bytesPerPixel], previous[i], previous[i - bytesPerPixel]);
+        }
+
+        unsigned long sum = 0;
+        for (size_t i = 0; i < length; i++)
+            sum += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+        if (sum < bestSum)
+        {
+            bestSum = sum;
+            out[0] = filter;
+            memcpy(out + 1, candidate, length);
+        }
+    }
+}
+
+
+/**
+ *   @brief Converts one top-down BGRA row to RGBA, or copies a row of palette indices
+ *
+ *   @param out converted row
+ *   @param data image data
+ *   @param y row number
+ *   @param width image width
+ *   @param pitch bytes per row of the image data
+ *   @param indexed 1 for palette indices, 0 for BGRA
+ */
+static void png_load_row(unsigned char *out, const unsigned char *data, int y, int width, int pitch, int indexed)
+{
+    const unsigned char *row = data + (size_t)y * pitch;
+    if (indexed)
+    {
+        memcpy(out, row, width);
+        return;
+    }
+    for (int x = 0; x < width; x++)
+    {
+        out[x * 4 + 0] = row[x * 4 + 2];
+        out[x * 4 + 1] = row[x * 4 + 1];
+        out[x * 4 + 2] = row[x * 4 + 0];
+        out[x * 4 + 3] = row[x * 4 + 3];
+    }
+}
+
+
+/**
+ *   @brief Saves a PNG, filtering and deflating bands of rows in parallel
+ *
+ *   @param fileName output file name
+ *   @param data top-down 8-bit palette indices (palette given) or raw BGRA data (palette NULL)
+ *   @param width image width
+ *   @param height image height
+ *   @param pitch bytes per row of data
+ *   @param palette BGRA palette entries or NULL for a 32-bit RGBA image
+ *   @param numberOfColors number of palette entries (at most 256)
+ *   @param level zlib compression level (0-9)
+ *
+ *   @return 1 if the image was saved, 0 otherwise
+ */
+static int save_png_parallel(const char *fileName, const unsigned char *data, int width, int height, int pitch, const unsigned char *palette,
+                             int numberOfColors, int level)
+{
+    int indexed = palette != NULL;
+    int bytesPerPixel = indexed ? 1 : 4;
+    size_t rowLength = (size_t)width * bytesPerPixel;
+    int numberOfBands = (height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    unsigned char **compressed = calloc(numberOfBands, sizeof(unsigned char *));
+    size_t *compressedSize = calloc(numberOfBands, sizeof(size_t));
+    uLong *adler = calloc(numberOfBands, sizeof(uLong));
+    size_t *filteredSize = calloc(numberOfBands, sizeof(size_t));
+    int failed = 0;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int band = 0; band < numberOfBands; band++)
+    {
+        int firstRow = band * PNG_BAND_ROWS;
+        int lastRow = firstRow + PNG_BAND_ROWS < height ? firstRow + PNG_BAND_ROWS : height;
+        unsigned char *filtered = malloc((lastRow - firstRow) * (rowLength + 1));
+        unsigned char *row = malloc(rowLength);
+        unsigned char *previous = calloc(rowLength, 1);
+        unsigned char *candidate = malloc(rowLength);
+
+        // Filters look at the row above, also across band boundaries
+        if (firstRow > 0)
+            png_load_row(previous, data, firstRow - 1, width, pitch, indexed);
+        for (int y = firstRow; y < lastRow; y++)
+        {
+            png_load_row(row, data, y, width, pitch, indexed);
+            unsigned char *out = filtered + (y - firstRow) * (rowLength + 1);
+            if (indexed)
+            {
+                // Palette indices are not continuous values, so they are stored unfiltered
+                out[0] = 0;
+                memcpy(out + 1, row, rowLength);
+            }
+            else
+            {
+                png_filter_row(out, row, previous, rowLength, bytesPerPixel, candidate);
+            }
+            unsigned char *swap = previous;
+            previous = row;
+            row = swap;
+        }
+
+        filteredSize[band] = (lastRow - firstRow) * (rowLength + 1);
+        adler[band] = adler32(adler32(0L, Z_NULL, 0), filtered, filteredSize[band]);
+
+        // Raw deflate; sync flush leaves the stream byte aligned and open for the next band
+        z_stream stream = {0};
+        deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        size_t capacity = deflateBound(&stream, filteredSize[band]) + 64;
+        compressed[band] = malloc(capacity);
+        stream.next_in = filtered;
+        stream.avail_in = filteredSize[band];
+        stream.next_out = compressed[band];
+        stream.avail_out = capacity;
+        int result = deflate(&stream, band == numberOfBands - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+        if (result == Z_STREAM_ERROR || stream.avail_in > 0 || (band == numberOfBands - 1 && result != Z_STREAM_END))
+        {
+            #ifdef _OPENMP
+            #pragma omp atomic write
+            #endif
+            failed = 1;
+        }
+        compressedSize[band] = capacity - stream.avail_out;
+        deflateEnd(&stream);
+
+        free(filtered);
+        free(row);
+        free(previous);
+        free(candidate);
+    }
+
+    FILE *file = failed ? NULL : fopen(fileName, "wb");
+    int saved = file != NULL;
+    if (file)
+    {
+        static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+        saved &= fwrite(signature, 1, 8, file) == 8;
+
+        unsigned char header[13];
+        png_store32(header, width);
+        png_store32(header + 4, height);
+        header[8] = 8;
+        header[9] = indexed ? 3 : 6;
+        header[10] = header[11] = header[12] = 0;
+        saved &= png_write_chunk(file, "IHDR", header, 13);
+
+        if (indexed)
+        {
+            unsigned char colors[256 * 3], alpha[256];
+            int transparent = 0;
+            for (int k = 0; k < numberOfColors; k++)
+            {
+                colors[k * 3 + 0] = palette[k * 4 + 2];
+                colors[k * 3 + 1] = palette[k * 4 + 1];
+                colors[k * 3 + 2] = palette[k * 4 + 0];
+                alpha[k] = palette[k * 4 + 3];
+                transparent |= alpha[k] != 255;
+            }
+            saved &= png_write_chunk(file, "PLTE", colors, numberOfColors * 3);
+            if (transparent)
+                saved &= png_write_chunk(file, "tRNS", alpha, numberOfColors);
+        }
+
+        // zlib header, the deflate data of every band and the combined Adler-32
+        int levelFlag = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        unsigned char zlibHeader[2] = {0x78, levelFlag << 6};
+        zlibHeader[1] += 31 - ((zlibHeader[0] * 256 + zlibHeader[1]) % 31);
+        saved &= png_write_chunk(file, "IDAT", zlibHeader, 2);
+
+        uLong checksum = adler[0];
+        for (int band = 0; band < numberOfBands; band++)
+        {
+            if (band > 0)
+                checksum = adler32_combine(checksum, adler[band], filteredSize[band]);
+            saved &= png_write_chunk(file, "IDAT", compressed[band], compressedSize[band]);
+        }
+        unsigned char trailer[4];
+        png_store32(trailer, checksum);
+        saved &= png_write_chunk(file, "IDAT", trailer, 4);
+        saved &= png_write_chunk(file, "IEND", NULL, 0);
+        saved &= fclose(file) == 0;
+    }
+
+    for (int band = 0; band < numberOfBands; band++)
+        free(compressed[band]);
+    free(compressed);
+    free(compressedSize);
+    free(adler);
+    free(filteredSize);
+    return saved;
+}
+
+
+/**
+ *   @brief Thread entry of png_save_async
+ *
+ *   @param argument struct PngJob to save
+ *
+ *   @return NULL
+ */
+static void *png_job_run(void *argument)
+{
+    struct PngJob *job = argument;
+    job->saved = save_png_parallel(job->fileName, job->data, job->width, job->height, job->pitch, job->palette, job->numberOfColors, job->level);
+    return NULL;
+}
+
+
+/**
+ *   @brief Starts save_png_parallel on a background thread; the data must stay valid until png_save_wait
+ *
+ *   @param job filled in save job
+ */
+static inline void png_save_async(struct PngJob *job)
+{
+    // Without a thread the image is saved right away
+    job->started = pthread_create(&job->thread, NULL, png_job_run, job) == 0;
+    if (!job->started)
+        png_job_run(job);
+}
+
+
+/**
+ *   @brief Waits for a background save
+ *
+ *   @param job job started with png_save_async
+ *
+ *   @return 1 if the image was saved, 0 otherwise
+ */
+static inline int png_save_wait(struct PngJob *job)
+{
+    if (job->started)
+        pthread_join(job->thread, NULL);
+    return job->saved;
+}
+
+
+/**
+ *   @brief Prints the palette as #RRGGBBAA colours
+ *
+ *   @param palette BGRA palette entries
+ *   @param numberOfColors number of palette entries
+ */
+static inline void print_palette(const unsigned char *palette, int numberOfColors)
+{
+    printf("Paleta:");
+    for (int k = 0; k < numberOfColors; k++)
+        printf(" #%02x%02x%02x%02x", palette[k * 4 + 2], palette[k * 4 + 1], palette[k * 4 + 0], palette[k * 4 + 3]);
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/**
+ *   @brief Prints the encode time, throughput, size and compression ratio of a written output file
+ *
+ *   The ratio compares the file with raw 32-bit RGBA data.
+ *
+ *   @param fileName output file name
+ *   @param seconds time spent encoding and writing the file
+ *   @param numberOfPixels number of pixels in the image
+ */
+static void print_output_stats(const char *fileName, double seconds, long long numberOfPixels)
+{
+    struct stat fileStat;
+    long long size = stat(fileName, &fileStat) == 0 ? (long long)fileStat.st_size : -1;
+
+    printf("Zapis slike: %f sekund (%.1f Mpx/s), %lld bajtov, razmerje %.2f\n", seconds, numberOfPixels / seconds / 1e6, size,
+           size > 0 ? 4.0 * numberOfPixels / size : 0.0);
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef PDE_ASSIGN_H
+#define PDE_ASSIGN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Nearest-centroid search over centroids sorted by luma (--assign pde in the CPU programs).
+ *
+ * The projection p = B + 5G + 3R (integer luma weights, alpha left out) satisfies
+ * (p(x) - p(c))^2 <= PDE_NORM * |x - c|^2 by Cauchy-Schwarz, so a search that starts at the sample's
+ * position in the sorted order and walks outwards can stop on a side as soon as the projection gap alone
+ * rules out the best distance. Every candidate's distance is summed channel by channel and abandoned as
+ * soon as the partial sum exceeds the best one (partial distance elimination). Ties go to the lowest
+ * centroid index, so the result is the same as the brute-force scan.
+ */
+
+#define PDE_NORM (1 * 1 + 5 * 5 + 3 * 3)
+
+struct PdeIndex
+{
+    int numberOfClusters;
+    int *projection;                // Projections in increasing order
+    int *order;                     // Centroid index of every sorted position
+    unsigned char *sorted;          // Centroids in sorted order, 4 bytes each
+};
+
+
+/**
+ *   @brief Returns the luma projection of a BGRA sample
+ *
+ *   @param sample 4-byte sample
+ *
+ *   @return projection
+ */
+static int pde_project(const unsigned char *sample)
+{
+    return sample[0] + 5 * sample[1] + 3 * sample[2];
+}
+
+
+/**
+ *   @brief Sorts the centroids by projection (called after every centroid update)
+ *
+ *   @param index index, zero-initialized before the first call
+ *   @param centroids centroids, 4 bytes each
+ *   @param numberOfClusters number of centroids
+ */
+static void pde_build(struct PdeIndex *index, const unsigned char *centroids, int numberOfClusters)
+{
+    if (index->order == NULL)
+    {
+        index->projection = malloc(numberOfClusters * sizeof(int));
+        index->order = malloc(numberOfClusters * sizeof(int));
+        index->sorted = malloc(numberOfClusters * 4 * sizeof(unsigned char));
+    }
+    index->numberOfClusters = numberOfClusters;
+
+    // Insertion sort, stable so equal projections stay in index order
+    for (int k = 0; k < numberOfClusters; k++)
+    {
+        int value = pde_project(centroids + k * 4);
+        int position = k;
+        while (position > 0 && index->projection[position - 1] > value)
+        {
+            index->projection[position] = index->projection[position - 1];
+            index->order[position] = index->order[position - 1];
+            position--;
+        }
+        index->projection[position] = value;
+        index->order[position] = k;
+    }
+    for (int position = 0; position < numberOfClusters; position++)
+        memcpy(index->sorted + position * 4, centroids + index->order[position] * 4, 4);
+}
+
+
+/**
+ *   @brief Frees the index
+ *
+ *   @param index index built with pde_build
+ */
+static void pde_free(struct PdeIndex *index)
+{
+    free(index->projection);
+    free(index->order);
+    free(index->sorted);
+    memset(index, 0, sizeof(*index));
+}
+
+
+/**
+ *   @brief Tries one candidate with partial distance elimination
+ *
+ *   @param index centroid index
+ *   @param position sorted position of the candidate
+ *   @param sample 4-byte sample
+ *   @param best best squared distance so far, updated
+ *   @param bestIndex centroid index of best, updated
+ *   @param evaluations number of (partial) distance evaluations, incremented
+ */
+static void pde_try(const struct PdeIndex *index, int position, const unsigned char *sample, int *best, int *bestIndex, long long *evaluations)
+{
+    (*evaluations)++;
+    const unsigned char *centroid = index->sorted + position * 4;
+    int deviation = 0;
+    for (int channel = 0; channel < 4; channel++)
+    {
+        deviation += (sample[channel] - centroid[channel]) * (sample[channel] - centroid[channel]);
+        if (deviation > *best)
+            return;
+    }
+    int k = index->order[position];
+    if (deviation < *best || (deviation == *best && k < *bestIndex))
+    {
+        *best = deviation;
+        *bestIndex = k;
+    }
+}
+
+
+/**
+ *   @brief Returns the exact nearest centroid of a sample (lowest index on ties)
+ *
+ *   @param index centroid index
+ *   @param sample 4-byte sample
+ *   @param previous centroid index of the sample in the previous iteration (or another good guess) or -1
+ *   @param previousDeviation squared distance to previous if the caller already has it (and counted it), otherwise -1
+ *   @param centroids centroids, 4 bytes each, in index order
+ *   @param deviation squared distance to the nearest centroid, set on return
+ *   @param evaluations number of (partial) distance evaluations, incremented
+ *
+ *   @return index of the nearest centroid
+ */
+static int pde_nearest(const struct PdeIndex *index, const unsigned char *sample, int previous, int previousDeviation, const unsigned char *centroids,
+                       int *deviation, long long *evaluations)
+{
+    int best = INT_MAX;
+    int bestIndex = INT_MAX;
+
+    // The previous centroid is usually still the nearest one and gives a tight bound from the start
+    if (previous >= 0 && previousDeviation >= 0)
+    {
+        best = previousDeviation;
+        bestIndex = previous;
+    }
+    else if (previous >= 0)
+    {
+        const unsigned char *centroid = centroids + previous * 4;
+        best = (sample[0] - centroid[0]) * (sample[0] - centroid[0]) + (sample[1] - centroid[1]) * (sample[1] - centroid[1]) +
+               (sample[2] - centroid[2]) * (sample[2] - centroid[2]) + (sample[3] - centroid[3]) * (sample[3] - centroid[3]);
+        bestIndex = previous;
+        (*evaluations)++;
+    }
+
+    // First position with a projection not below the sample's
+    int value = pde_project(sample);
+    int low = 0, high = index->numberOfClusters;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (index->projection[middle] < value)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // Walk outwards, always on the side with the smaller gap; a side ends once gap^2 > PDE_NORM * best
+    int down = low - 1, up = low;
+    while (down >= 0 || up < index->numberOfClusters)
+    {
+        long long downGap = down >= 0 ? value - index->projection[down] : LLONG_MAX;
+        long long upGap = up < index->numberOfClusters ? index->projection[up] - value : LLONG_MAX;
+        long long bound = (long long)PDE_NORM * best;
+
+        if (down >= 0 && downGap * downGap > bound)
+            down = -1;
+        if (up < index->numberOfClusters && upGap * upGap > bound)
+            up = index->numberOfClusters;
+
+        if (down >= 0 && (up >= index->numberOfClusters || downGap <= upGap))
+            pde_try(index, down--, sample, &best, &bestIndex, evaluations);
+        else if (up < index->numberOfClusters)
+            pde_try(index, up++, sample, &best, &bestIndex, evaluations);
+    }
+
+    *deviation = best;
+    return bestIndex;
+}
+
+#endif
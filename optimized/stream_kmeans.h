@@ -0,0 +1,369 @@
+#ifndef STREAM_KMEANS_H
+#define STREAM_KMEANS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Out-of-core k-means for images that do not fit in memory (used by --stream in the CPU programs).
+ *
+ * The input is a binary PPM (P6, RGB) or PAM (P7, RGB or RGB_ALPHA) file with 8-bit samples, mapped
+ * with mmap and read in strips of rows. No per-pixel state is kept: every iteration streams all strips,
+ * accumulates 64-bit per-cluster sums (per thread with OpenMP) and releases the pages of each strip once
+ * it is done, so the resident memory stays around one strip. The quantized image is written strip by
+ * strip in the format of the input. All pixel offsets are 64-bit.
+ */
+
+// Memory-mapped PPM/PAM image
+struct StreamImage
+{
+    unsigned char *map;
+    size_t mapSize;
+    const unsigned char *pixels;
+    long long width, height;
+    int channels;
+    char header[128];
+};
+
+
+/**
+ *   @brief Reads the next unsigned number of a PPM header, skipping whitespace and comments
+ *
+ *   @param data file data
+ *   @param size file size
+ *   @param position current offset, advanced past the number
+ *
+ *   @return the number or -1 if there is none
+ */
+static long long stream_header_number(const unsigned char *data, size_t size, size_t *position)
+{
+    while (*position < size && (isspace(data[*position]) || data[*position] == '#'))
+    {
+        if (data[*position] == '#')
+            while (*position < size && data[*position] != '\n')
+                (*position)++;
+        else
+            (*position)++;
+    }
+    if (*position >= size || !isdigit(data[*position]))
+        return -1;
+
+    long long value = 0;
+    while (*position < size && isdigit(data[*position]))
+        value = value * 10 + (data[(*position)++] - '0');
+    return value;
+}
+
+
+/**
+ *   @brief Maps a binary PPM or PAM file and parses its header
+ *
+ *   @param fileName input file name
+ *   @param image mapped image, filled in on success
+ *
+ *   @return 1 on success, 0 if the file is missing or not an 8-bit P6/P7 file
+ */
+static int stream_open(const char *fileName, struct StreamImage *image)
+{
+    int file = open(fileName, O_RDONLY);
+    if (file < 0)
+        return 0;
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0 || fileStat.st_size < 3)
+    {
+        close(file);
+        return 0;
+    }
+
+    image->mapSize = fileStat.st_size;
+    image->map = mmap(NULL, image->mapSize, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (image->map == MAP_FAILED)
+        return 0;
+
+    const unsigned char *data = image->map;
+    size_t position = 2;
+    long long maxValue = -1;
+    image->width = image->height = -1;
+
+    if (data[0] == 'P' && data[1] == '6')
+    {
+        image->channels = 3;
+        image->width = stream_header_number(data, image->mapSize, &position);
+        image->height = stream_header_number(data, image->mapSize, &position);
+        maxValue = stream_header_number(data, image->mapSize, &position);
+        position++;
+    }
+    else if (data[0] == 'P' && data[1] == '7')
+    {
+        // PAM header: "KEY value" lines up to ENDHDR
+        image->channels = 0;
+        while (position < image->mapSize)
+        {
+            while (position < image->mapSize && isspace(data[position]))
+                position++;
+            if (image->mapSize - position >= 6 && memcmp(data + position, "ENDHDR", 6) == 0)
+            {
+                position += 7;
+                break;
+            }
+            if (image->mapSize - position >= 5 && memcmp(data + position, "WIDTH", 5) == 0)
+                position += 5, image->width = stream_header_number(data, image->mapSize, &position);
+            else if (image->mapSize - position >= 6 && memcmp(data + position, "HEIGHT", 6) == 0)
+                position += 6, image->height = stream_header_number(data, image->mapSize, &position);
+            else if (image->mapSize - position >= 5 && memcmp(data + position, "DEPTH", 5) == 0)
+                position += 5, image->channels = stream_header_number(data, image->mapSize, &position);
+            else if (image->mapSize - position >= 6 && memcmp(data + position, "MAXVAL", 6) == 0)
+                position += 6, maxValue = stream_header_number(data, image->mapSize, &position);
+            else
+                while (position < image->mapSize && data[position] != '\n')
+                    position++;
+        }
+    }
+
+    if (image->width <= 0 || image->height <= 0 || maxValue != 255 || (image->channels != 3 && image->channels != 4) ||
+        position + (size_t)(image->width * image->height * image->channels) > image->mapSize || position >= sizeof(image->header))
+    {
+        munmap(image->map, image->mapSize);
+        return 0;
+    }
+
+    memcpy(image->header, data, position);
+    image->header[position] = '\0';
+    image->pixels = data + position;
+    madvise(image->map, image->mapSize, MADV_SEQUENTIAL);
+    return 1;
+}
+
+
+/**
+ *   @brief Returns the index of the centroid nearest to a pixel
+ *
+ *   @param pixel RGB or RGBA sample
+ *   @param centroids centroids, 4 values each (alpha 255 for RGB images)
+ *   @param numberOfClusters number of centroids
+ *   @param channels 3 or 4
+ *   @param deviation squared distance to the nearest centroid, set on return
+ *
+ *   @return index of the nearest centroid
+ */
+static int stream_nearest(const unsigned char *pixel, const int *centroids, int numberOfClusters, int channels, int *deviation)
+{
+    int nearest = 0;
+    int minDeviation = -1;
+
+    for (int k = 0; k < numberOfClusters; k++)
+    {
+        const int *centroid = centroids + k * 4;
+        int value = 0;
+        for (int channel = 0; channel < channels; channel++)
+            value += (pixel[channel] - centroid[channel]) * (pixel[channel] - centroid[channel]);
+        if (minDeviation < 0 || value < minDeviation)
+        {
+            minDeviation = value;
+            nearest = k;
+        }
+    }
+
+    *deviation = minDeviation;
+    return nearest;
+}
+
+
+/**
+ *   @brief Returns a random 64-bit pixel index below numberOfPixels
+ *
+ *   @param numberOfPixels number of pixels
+ *
+ *   @return random pixel index
+ */
+static long long stream_random_pixel(long long numberOfPixels)
+{
+    unsigned long long value = ((unsigned long long)rand() << 31) ^ (unsigned long long)rand();
+    return value % numberOfPixels;
+}
+
+
+/**
+ *   @brief Clusters a memory-mapped PPM/PAM image strip by strip and writes the quantized image
+ *
+ *   @param inputName binary PPM or PAM input
+ *   @param outputName output file, written in the format of the input
+ *   @param numberOfClusters number of centroids
+ *   @param numberOfIterations maximum number of iterations (stops earlier once no centroid moves)
+ *   @param stripRows rows per strip
+ *
+ *   @return 1 on success, 0 otherwise
+ */
+static int stream_kmeans(const char *inputName, const char *outputName, int numberOfClusters, int numberOfIterations, int stripRows)
+{
+    struct StreamImage image;
+    if (!stream_open(inputName, &image))
+    {
+        fprintf(stderr, "Could not map '%s' (binary PPM or PAM with 8-bit samples expected).\n", inputName);
+        return 0;
+    }
+
+    long long numberOfPixels = image.width * image.height;
+    size_t rowSize = (size_t)image.width * image.channels;
+    long long numberOfStrips = (image.height + stripRows - 1) / stripRows;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    int *centroids = malloc(numberOfClusters * 4 * sizeof(int));
+    long long *sum = malloc(numberOfClusters * 4 * sizeof(long long));
+    long long *n = malloc(numberOfClusters * sizeof(long long));
+    long long inertia = 0;
+    int iterationsRun = 0;
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Random samples as initial centroids
+    for (int k = 0; k < numberOfClusters; k++)
+    {
+        const unsigned char *pixel = image.pixels + stream_random_pixel(numberOfPixels) * image.channels;
+        for (int channel = 0; channel < 4; channel++)
+            centroids[k * 4 + channel] = channel < image.channels ? pixel[channel] : 255;
+    }
+
+    for (int i = 0; i < numberOfIterations; i++)
+    {
+        memset(sum, 0, numberOfClusters * 4 * sizeof(long long));
+        memset(n, 0, numberOfClusters * sizeof(long long));
+        inertia = 0;
+
+        for (long long strip = 0; strip < numberOfStrips; strip++)
+        {
+            long long firstRow = strip * stripRows;
+            long long lastRow = firstRow + stripRows < image.height ? firstRow + stripRows : image.height;
+            const unsigned char *stripPixels = image.pixels + firstRow * rowSize;
+            long long stripPixelCount = (lastRow - firstRow) * image.width;
+            long long stripInertia = 0;
+
+            #ifdef _OPENMP
+            #pragma omp parallel reduction(+ : stripInertia)
+            #endif
+            {
+                long long *localSum = calloc(numberOfClusters * 4, sizeof(long long));
+                long long *localN = calloc(numberOfClusters, sizeof(long long));
+
+                #ifdef _OPENMP
+                #pragma omp for
+                #endif
+                for (long long j = 0; j < stripPixelCount; j++)
+                {
+                    const unsigned char *pixel = stripPixels + j * image.channels;
+                    int deviation;
+                    int nearest = stream_nearest(pixel, centroids, numberOfClusters, image.channels, &deviation);
+                    stripInertia += deviation;
+                    for (int channel = 0; channel < image.channels; channel++)
+                        localSum[nearest * 4 + channel] += pixel[channel];
+                    localN[nearest]++;
+                }
+
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                for (int k = 0; k < numberOfClusters; k++)
+                {
+                    for (int channel = 0; channel < 4; channel++)
+                        sum[k * 4 + channel] += localSum[k * 4 + channel];
+                    n[k] += localN[k];
+                }
+
+                free(localSum);
+                free(localN);
+            }
+            inertia += stripInertia;
+
+            // Drop the pages of the finished strip, so resident memory stays bounded by the strip size
+            size_t stripBegin = (stripPixels - image.map) / pageSize * pageSize;
+            madvise(image.map + stripBegin, (stripPixels - image.map) + stripPixelCount * image.channels - stripBegin, MADV_DONTNEED);
+        }
+
+        // New centroids; an empty cluster gets a random sample
+        int moved = 0;
+        for (int k = 0; k < numberOfClusters; k++)
+        {
+            int centroid[4];
+            if (n[k] == 0)
+            {
+                const unsigned char *pixel = image.pixels + stream_random_pixel(numberOfPixels) * image.channels;
+                for (int channel = 0; channel < 4; channel++)
+                    centroid[channel] = channel < image.channels ? pixel[channel] : 255;
+            }
+            else
+            {
+                for (int channel = 0; channel < 4; channel++)
+                    centroid[channel] = channel < image.channels ? sum[k * 4 + channel] / n[k] : 255;
+            }
+            moved |= memcmp(centroid, centroids + k * 4, sizeof(centroid)) != 0;
+            memcpy(centroids + k * 4, centroid, sizeof(centroid));
+        }
+
+        iterationsRun = i + 1;
+        if (!moved)
+            break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("Čas izvajanja programa: %f sekund\n", elapsed);
+    printf("Iteracije: %d / %d%s\n", iterationsRun, numberOfIterations, iterationsRun < numberOfIterations ? " (konvergenca)" : "");
+    printf("Inercija: %lld\n", inertia);
+
+    // Quantized output, one strip at a time
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FILE *output = fopen(outputName, "wb");
+    int written = output != NULL;
+    unsigned char *stripBuffer = malloc((size_t)stripRows * rowSize);
+    if (output)
+        written &= fputs(image.header, output) >= 0;
+
+    for (long long strip = 0; written && strip < numberOfStrips; strip++)
+    {
+        long long firstRow = strip * stripRows;
+        long long lastRow = firstRow + stripRows < image.height ? firstRow + stripRows : image.height;
+        const unsigned char *stripPixels = image.pixels + firstRow * rowSize;
+        long long stripPixelCount = (lastRow - firstRow) * image.width;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (long long j = 0; j < stripPixelCount; j++)
+        {
+            int deviation;
+            int nearest = stream_nearest(stripPixels + j * image.channels, centroids, numberOfClusters, image.channels, &deviation);
+            for (int channel = 0; channel < image.channels; channel++)
+                stripBuffer[j * image.channels + channel] = centroids[nearest * 4 + channel];
+        }
+
+        written &= fwrite(stripBuffer, image.channels, stripPixelCount, output) == (size_t)stripPixelCount;
+
+        size_t stripBegin = (stripPixels - image.map) / pageSize * pageSize;
+        madvise(image.map + stripBegin, (stripPixels - image.map) + stripPixelCount * image.channels - stripBegin, MADV_DONTNEED);
+    }
+    if (output)
+        written &= fclose(output) == 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (written)
+        printf("Zapis slike: %f sekund\n", (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0);
+    else
+        fprintf(stderr, "Could not write '%s'.\n", outputName);
+
+    free(stripBuffer);
+    free(centroids);
+    free(sum);
+    free(n);
+    munmap(image.map, image.mapSize);
+    return written;
+}
+
+#endif